@@ -4,9 +4,22 @@
 #include <cstdint>
 #include <vector>
 #include <string>
-#include <queue>
+#include <deque>
+#include <list>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <utility>
+#include <chrono>
+#include <cstring>
 #include "fast_bitset.h"
+#include "utils.h"
+#include "pages.h"
+#include "mark_stack.h"
+#include "gc_workers.h"
 #ifdef PLATFORM_X64
 #include "x86_64.h"
 #else
@@ -17,28 +30,111 @@
 #endif
 #endif
 
-typedef uint8_t mark_id_t;
 typedef uint8_t fixed_count_t;
 typedef void (*func_ptr)();
 
 #define PREFERRED_HEAP_SIZE 0x1000
-#define HEAP_UNIT_SIZE sizeof(core_representation)
+#ifdef GC_COMPACT_HEADERS
+//Blocks are the unit of allocation and of every per-heap bitmap. With compact headers
+//objects are often a multiple of 8 bytes but not of 16, so blocks are 8 bytes.
+#define HEAP_UNIT_SIZE size_t(8)
+#else
+//Blocks are the unit of allocation and of every per-heap bitmap. Two words, so that small
+//objects take a single block.
+#define HEAP_UNIT_SIZE (2 * sizeof(void*))
+#endif
+
+//type_info::type_id are split in chunks of 1 << TYPE_ID_CHUNK_BITS types
+#define TYPE_ID_CHUNK_BITS 12
+#define TYPE_ID_CHUNK_COUNT 4096
+
+/**
+ * Number of free run size classes kept by each gc_heap.
+ * Class i holds runs of exactly i + 1 blocks, except the last class,
+ * which holds every run of SIZE_CLASS_COUNT blocks or more.
+ */
+#define SIZE_CLASS_COUNT 16
+
+/**
+ * Allocations up to MAX_BUFFERED_ALLOC_SIZE bytes are bump allocated from a buffer
+ * of at most ALLOC_BUFFER_SIZE bytes reserved in one of the heaps.
+ */
+#define ALLOC_BUFFER_SIZE PREFERRED_HEAP_SIZE
+#define MAX_BUFFERED_ALLOC_SIZE (ALLOC_BUFFER_SIZE / 4)
+
+/**
+ * Allocations of more than LARGE_OBJECT_SIZE bytes get pages of their own in the large
+ * object space. They count towards the allocation budget like everything else.
+ */
+#define LARGE_OBJECT_SIZE PREFERRED_HEAP_SIZE
+
+//Overwritten references buffered by the mutator before the concurrent marker gets them
+#define SATB_BUFFER_SIZE 256
+
+#define NOT_FORWARDED UINT32_MAX
+//Heaps are only compacted when at least 1/COMPACTION_MIN_FREE_DIVISOR of them is free
+#define COMPACTION_MIN_FREE_DIVISOR 4
 
 struct class_type;
 struct gc_heap;
+struct gc_heap_stats;
 struct type_info;
 
+#ifdef GC_COMPACT_HEADERS
+/**
+ * Compact headers: the type is a 32-bit type_info::type_id instead of a pointer, so that
+ * on 64-bit platforms an int32 field can use the rest of the first word. Marks are in the
+ * heap bitmaps either way. Use object_type and set_object_type to get at the type.
+ */
+struct core_representation {
+	uint32_t type_id;
+};
+#else
 struct core_representation {
 	type_info* type;
-	mark_id_t last_mark;
 };
+#endif
 
 struct array_representation {
 	core_representation core;
 	size_t array_length;
-	void* content;
+
+	//The elements follow the header, in the same allocation
+	inline void* content() { return this + 1; }
+	inline const void* content() const { return this + 1; }
 };
 
+#ifdef GC_COMPRESSED_REFERENCES
+/**
+ * Compressed references: reference slots of objects, arrays and static fields hold the
+ * offset of the object in the reference space (see alloc_pages), shifted right by
+ * REFERENCE_SHIFT, or 0 for null. References anywhere else, stacks included, are pointers.
+ */
+typedef uint32_t reference_t;
+
+inline core_representation* decode_reference(reference_t reference) {
+	return reference ? (core_representation*) (reference_space_base + (uintptr_t(reference) << REFERENCE_SHIFT)) :
+			nullptr;
+}
+inline reference_t encode_reference(core_representation* object) {
+	return object ? reference_t(uintptr_t((char*) object - reference_space_base) >> REFERENCE_SHIFT) : 0;
+}
+#else
+//What a reference slot holds
+typedef core_representation* reference_t;
+
+inline core_representation* decode_reference(reference_t reference) { return reference; }
+inline reference_t encode_reference(core_representation* object) { return object; }
+#endif
+
+//For slots that the mutator and a concurrent marker may access at the same time
+inline core_representation* load_reference(const reference_t* slot) {
+	return decode_reference(__atomic_load_n(slot, __ATOMIC_ACQUIRE));
+}
+inline void store_reference(reference_t* slot, core_representation* value) {
+	__atomic_store_n(slot, encode_reference(value), __ATOMIC_RELEASE);
+}
+
 struct field_flags {
 	unsigned is_public : 1;
 	unsigned is_static : 1;
@@ -71,8 +167,20 @@ struct method {
 	size_t virtual_offset;
 };
 
+//count consecutive reference slots, starting offset bytes into the object
+struct reference_range {
+	size_t offset;
+	size_t count;
+};
+
+//class_id of a class that was never pushed to a gc_type_store
+#define NO_CLASS_ID UINT32_MAX
+
 struct class_type {
+	//Must not change once the class is pushed, it is indexed by gc_type_store
 	std::string full_name;
+	//Index in gc_type_store::class_types. Set by push_class_type.
+	uint32_t class_id;
 	class_type* base_type; //NULL for no base
 	size_t computed_size;
 	size_t static_size;
@@ -80,6 +188,10 @@ struct class_type {
 	std::vector<method> methods;
 	type_info* owned_type;
 	void* static_field_data;
+	//Reference fields of an instance, inherited ones included. Set by compute_sizes.
+	std::vector<reference_range> reference_ranges;
+	//Offsets of the static reference fields in static_field_data. Set by compute_static_sizes.
+	std::vector<size_t> static_reference_offsets;
 };
 
 typedef enum {
@@ -94,6 +206,8 @@ typedef enum {
 
 struct type_info {
 	type_category_t type_category;
+	//Index in type_table, set when the type store creates the type
+	uint32_t type_id;
 	type_info* array_type;
 };
 
@@ -107,20 +221,119 @@ struct class_type_info {
 	class_type* cls;
 };
 
+/**
+ * Every live type_info of the process, by type_id, so that a compact header is enough to
+ * find the type of an object without knowing its gc_context. A gc_type_store removes its
+ * types when it is destroyed, together with its gc_context and so with every object of
+ * those types, and their ids are then reused. Chunks are never moved once published, so
+ * looking up an id takes no lock.
+ */
+struct type_table {
+	static std::atomic<type_info**> chunks[TYPE_ID_CHUNK_COUNT];
+	//Ids handed out so far, removed ones included
+	static uint32_t type_count;
+	static std::vector<uint32_t> free_ids;
+	static std::mutex lock;
+
+	//Sets type->type_id
+	static void add(type_info* type);
+	static void remove(const type_info* type);
+	static inline type_info* get(uint32_t id) {
+		return chunks[id >> TYPE_ID_CHUNK_BITS].load(std::memory_order_acquire)
+				[id & ((1 << TYPE_ID_CHUNK_BITS) - 1)];
+	}
+};
+
+inline type_info* object_type(const core_representation* object) {
+#ifdef GC_COMPACT_HEADERS
+	return type_table::get(object->type_id);
+#else
+	return object->type;
+#endif
+}
+
+inline void set_object_type(core_representation* object, type_info* type) {
+#ifdef GC_COMPACT_HEADERS
+	object->type_id = type->type_id;
+#else
+	object->type = type;
+#endif
+}
+
+//Calls f(slot) for every reference slot of object, null or not
+template <typename F>
+inline void for_each_reference_slot(core_representation* object, F f) {
+	type_info* type = object_type(object);
+	if (type->type_category == TYPE_CLASS_OBJECT) {
+		const class_type* cls = ((class_type_info*) type)->cls;
+		for (const reference_range& range : cls->reference_ranges) {
+			reference_t* slots = (reference_t*) ((char*) object + range.offset);
+			for (size_t i = 0; i < range.count; ++i) {
+				f(&slots[i]);
+			}
+		}
+	}
+	else if (type->type_category == TYPE_ARRAY) {
+		array_representation* array = (array_representation*) object;
+		type_category_t content_category = ((array_type_info*) type)->content_type->type_category;
+		if (content_category == TYPE_ARRAY || content_category == TYPE_CLASS_OBJECT) {
+			reference_t* elements = (reference_t*) array->content();
+			for (size_t i = 0; i < array->array_length; ++i) {
+				f(&elements[i]);
+			}
+		}
+	}
+}
+
+struct free_run {
+	size_t start;
+	size_t length;
+};
+
 struct gc_heap {
 	size_t heap_size;
 	char* heap;
 	char* heap_aligned;
 	fast_bitset heap_bitset;
 	fast_bitset heap_starts;
+	//Blocks of everything marked in the current cycle, including non GC objects owned by live ones.
+	//An object is marked when the bit of its first block is set.
+	fast_bitset mark_bits;
+	size_t live_blocks;
+	//Starts of the objects in the remembered set, so that they are only added once
+	fast_bitset remembered_bits;
+	//Objects referenced from the stack, which must not be moved by compaction
+	fast_bitset pinned_bits;
+	//New block of each object start during compaction, NOT_FORWARDED if it stays. Empty otherwise.
+	std::vector<uint32_t> forwarding;
+
+	//Free runs of heap_bitset, indexed by size class. Rebuilt after each sweep.
+	std::vector<free_run> free_runs[SIZE_CLASS_COUNT];
+	//Set when released runs were pushed without being merged with their free neighbours
+	bool has_released_runs;
+	//Marked, but dead objects not freed yet. Must be swept before allocating from it.
+	bool needs_sweep;
+	//Young objects may have been allocated here since the last collection
+	bool allocated_since_gc;
 
 	gc_heap(size_t heap_size);
+	//Takes over pages from alloc_pages or map_file_pages. Whole pages, so that no two heaps
+	//ever share a page in the heap_map.
+	gc_heap(char* pages, size_t heap_size);
 	gc_heap(const gc_heap& other) = delete;
 	gc_heap(gc_heap&& other);
 	~gc_heap();
 
 	void* try_alloc(size_t size, bool is_gc_object);
+	bool try_reserve_run(size_t min_blocks, size_t max_blocks, free_run& reserved);
 	void free_non_gc_object(void* obj, size_t size);
+	void release_run(size_t start, size_t length);
+	void rebuild_free_runs();
+	void push_free_run(size_t start, size_t length);
+	gc_heap_stats get_stats() const;
+	static inline size_t size_class(size_t block_count) {
+		return block_count >= SIZE_CLASS_COUNT ? SIZE_CLASS_COUNT - 1 : block_count - 1;
+	}
 	inline bool contains(void* obj, bool is_gc_object) const {
 		if(obj >= heap_aligned && obj < heap_aligned + heap_size) {
 			if (uintptr_t((char*) obj - heap_aligned) % HEAP_UNIT_SIZE != 0) {
@@ -142,15 +355,86 @@ struct gc_heap {
 	gc_heap& operator=(const gc_heap& other);
 };
 
+/**
+ * A single object (or non GC block) in the large object space. It is never moved,
+ * and its pages go back to the OS as soon as it is swept.
+ */
+struct large_object {
+	char* start;
+	size_t size;
+	bool is_gc_object;
+	//Same meaning as the mark_bits of a gc_heap: set for everything marked since the
+	//last full collection, so unmarked objects are young or dead
+	bool marked;
+	bool remembered;
+};
+
+/**
+ * A run of blocks reserved in heap_bitset, handed out with a bump pointer.
+ * Blocks in [cursor, limit) are reserved but not yet in use.
+ */
+struct alloc_buffer {
+	gc_heap* heap;
+	size_t cursor;
+	size_t limit;
+};
+
+/**
+ * A mutator thread registered with a gc_context. Each one allocates from its own buffer.
+ */
+struct gc_thread {
+	void* stack_start;
+	//Where the stack was when the thread stopped for a collection, it is scanned up to stack_start
+	uintptr_t stack_pos;
+	//Stopped at a safepoint, or waiting in a blocking call, so a collector can scan its stack
+	std::atomic<bool> parked;
+	alloc_buffer buffer;
+	//See gc_context::satb_barrier
+	std::vector<core_representation*> satb_buffer;
+
+	gc_thread(void* stack_start) : stack_start(stack_start), stack_pos(0), parked(false) {
+		buffer.heap = nullptr;
+		buffer.cursor = 0;
+		buffer.limit = 0;
+	}
+};
+
 struct gc_type_store {
 	type_info primitive_types[LAST_PRIMITIVE_TYPE + 1];
+	//By class_id
 	std::vector<class_type*> class_types;
+	//Open addressing hash table of class ids by full_name, NO_CLASS_ID for empty slots.
+	//Its size is a power of two, and it's kept at most half full.
+	std::vector<uint32_t> class_index;
+	//Classes read from an image. The others belong to whoever pushed them.
+	std::vector<std::unique_ptr<class_type>> loaded_classes;
+	//Array and class types made by get_type_array and get_class_type, freed with the store
+	std::vector<type_info*> created_types;
 
 	friend class gc_context;
+
+	void add_reference_slot(class_type* cls, size_t offset);
+	static size_t hash_name(const char* name, size_t length);
+	void index_class(uint32_t id);
+	uint32_t find_class_id(const char* name, size_t length) const;
 public:
+	/**
+	 * When set, compute_sizes lays out the instance fields of each class with all the
+	 * references first, so that they form a single range, and fills padding with int32
+	 * fields. Base class fields still come first. Otherwise fields are in declaration order.
+	 */
+	bool reorder_fields;
+
 	gc_type_store();
+	//Pushed classes lose their owned_type, so that they can be used with another store
+	~gc_type_store();
+	gc_type_store(const gc_type_store& other) = delete;
 
-	void push_class_type(class_type* type) { class_types.push_back(type); }
+	/**
+	 * Gives the class the next class_id and indexes it by name. When several classes have
+	 * the same name, class_by_name finds the first one.
+	 */
+	void push_class_type(class_type* type);
 
 	type_info* get_type_void();
 	type_info* get_type_int32();
@@ -162,56 +446,512 @@ public:
 	void compute_sizes();
 	void compute_static_sizes();
 
-	class_type* class_by_name(std::string class_name);
-	const class_type* class_by_name(std::string class_name) const;
-
-	size_t measure_class_size(type_info* type) const;
-	size_t measure_direct_heap_size(type_info* type) const;
-	size_t measure_array_content_size(type_info* content_type, size_t len) const;
+	//Abort when there is no such class
+	class_type* class_by_name(const std::string& class_name);
+	const class_type* class_by_name(const std::string& class_name) const;
+	class_type* class_by_name(const char* name, size_t length);
+	const class_type* class_by_name(const char* name, size_t length) const;
+	//nullptr when there is no such class
+	class_type* find_class(const char* name, size_t length);
+	class_type* class_by_id(uint32_t id) { return id < class_types.size() ? class_types[id] : nullptr; }
+	const class_type* class_by_id(uint32_t id) const { return id < class_types.size() ? class_types[id] : nullptr; }
+
+	size_t measure_class_size(const type_info* type) const;
+	size_t measure_object_size(const core_representation* object) const;
+	size_t measure_direct_heap_size(const type_info* type) const;
+	size_t measure_array_content_size(const type_info* content_type, size_t len) const;
+	//Header and elements
+	size_t measure_array_size(const type_info* content_type, size_t len) const;
+	//The class name, "int32" or "void", followed by "[]" for each array level
+	std::string type_name(const type_info* type) const;
 
 	void log_headers();
 };
 
+/**
+ * Heap sizing and collection policy of a gc_context.
+ *
+ * Collections are triggered by an allocation budget: once that many bytes were allocated
+ * since the last collection, the next allocation that leaves the bump buffer collects first.
+ * After a full collection, the budget is set so that the live data makes up
+ * target_live_ratio of the heap once the budget is used up. When the heaps fill up before
+ * that, they grow geometrically instead of collecting.
+ */
+struct gc_config {
+	//Reserved up front, and allocated before the first collection
+	size_t min_heap_size;
+	//Limit on the total size of all heaps and large objects, 0 for none
+	size_t max_heap_size;
+	//Each new heap is (heap_growth_factor - 1) times the current heap size, if that is larger than needed
+	double heap_growth_factor;
+	//Live bytes over heap size to aim for, between 0 and 1
+	double target_live_ratio;
+	//Allocation budget when little or nothing is alive
+	size_t min_gc_budget;
+
+	//See set_lazy_sweep, set_generational and set_compaction
+	bool lazy_sweep;
+	bool generational;
+	bool compaction;
+
+	//Threads marking in parallel, including the collecting one
+	size_t mark_threads;
+	/**
+	 * Full collections triggered by the allocation budget mark on a background thread
+	 * while the program keeps running. Every reference store into a heap object must then
+	 * go through the store accessors. Such collections don't compact.
+	 */
+	bool concurrent_mark;
+
+	gc_config() : min_heap_size(0), max_heap_size(0), heap_growth_factor(2.0),
+			target_live_ratio(0.5), min_gc_budget(256 * PREFERRED_HEAP_SIZE),
+			lazy_sweep(true), generational(false), compaction(false), mark_threads(1),
+			concurrent_mark(false) {}
+};
+
+/**
+ * Time spent in each phase of a collection, in seconds, as seen by the collecting thread.
+ * For concurrent collections, only the pauses are counted.
+ */
+struct gc_phase_times {
+	//Thread stacks, and the remembered set in minor collections
+	double root_scan;
+	double static_scan;
+	//Tracing from the roots
+	double mark;
+	double compact;
+	//Including the heaps swept lazily after the collection
+	double sweep;
+
+	gc_phase_times() : root_scan(0), static_scan(0), mark(0), compact(0), sweep(0) {}
+
+	gc_phase_times& operator+=(const gc_phase_times& other) {
+		root_scan += other.root_scan;
+		static_scan += other.static_scan;
+		mark += other.mark;
+		compact += other.compact;
+		sweep += other.sweep;
+		return *this;
+	}
+};
+
+//What a gc_context did since it was created, see gc_context::get_stats
+struct gc_stats {
+	size_t full_collections;
+	size_t minor_collections;
+	//Allocation buffers count as a whole once reserved
+	size_t bytes_allocated;
+	size_t bytes_reclaimed;
+	//Bytes in use right after the last collection, and the size of all heaps and large objects
+	size_t live_bytes;
+	size_t heap_size;
+	//Pauses, in seconds, including the wait for the other threads to stop
+	size_t pauses;
+	double total_pause_time;
+	double max_pause_time;
+	//Of the last collection, and of all of them
+	gc_phase_times last_phases;
+	gc_phase_times total_phases;
+
+	gc_stats() : full_collections(0), minor_collections(0), bytes_allocated(0),
+			bytes_reclaimed(0), live_bytes(0), heap_size(0), pauses(0), total_pause_time(0),
+			max_pause_time(0) {}
+};
+
+//Occupancy of a single gc_heap, see gc_context::get_heap_stats
+struct gc_heap_stats {
+	size_t size;
+	//Blocks in use, including those reserved for allocation buffers
+	size_t used_bytes;
+	size_t free_bytes;
+	size_t free_runs;
+	size_t largest_free_run;
+	//1 - largest_free_run / free_bytes: 0 when all free space is in a single run
+	double fragmentation;
+};
+
+/**
+ * Called at the start and at the end of every collection, with all threads stopped.
+ * It must not allocate, nor trigger a collection.
+ */
+typedef std::function<void(const gc_stats& stats, bool full)> gc_callback;
+
 class gc_context {
 	std::unique_ptr<gc_type_store> type_store;
-	void* stack_start;
-	std::vector<gc_heap> heaps;
-	mark_id_t last_mark_id;
+	//A deque so that heap_map can point to the heaps
+	std::deque<gc_heap> heaps;
+	page_map<gc_heap> heap_map;
 	size_t last_alloc_heap;
-	char* first_heap;
-	char* last_heap;
+	gc_config config;
 
-	void mark();
-	void mark_conservative_region(uint32_t start, uint32_t end,
-			std::queue<core_representation*>& pending_list);
-	void mark(core_representation* object, std::queue<core_representation*>& pending_list);
+	//Registered threads
+	std::list<gc_thread> threads;
+	/**
+	 * The gc_thread of the running thread in each context it is registered with. A thread
+	 * may use several contexts, so the last one looked up is cached for alloc.
+	 */
+	struct thread_registration {
+		const gc_context* context;
+		gc_thread* thread;
+	};
+	static thread_local std::vector<thread_registration> thread_registrations;
+	static thread_local thread_registration last_thread;
+
+	//nullptr when the running thread isn't registered with this context
+	inline gc_thread* current_thread() {
+		if (last_thread.context == this) {
+			return last_thread.thread;
+		}
+		return find_current_thread();
+	}
+	gc_thread* find_current_thread();
+	//Forgets this context's registration of the running thread
+	void forget_current_thread();
+	//Held for everything but bump allocation, including whole collections
+	std::mutex heap_lock;
+	//Set while a collector waits for, or works with all other threads stopped
+	std::atomic<bool> safepoint_requested;
+	std::mutex safepoint_lock;
+	std::condition_variable safepoint_over;
+	//stop_the_world calls not matched by resume_the_world yet
+	size_t world_stops;
+	std::chrono::steady_clock::time_point pause_start;
+	//Length of every pause so far, in seconds, including the wait for the other threads
+	std::vector<double> pause_times;
+	//total_phases leaves out last_phases, which is still growing while heaps are swept lazily
+	gc_stats stats;
+	//Bytes in use when the current collection started
+	size_t used_before_gc;
+	gc_callback pre_gc_callback;
+	gc_callback post_gc_callback;
+	//Stacks to scan in the current collection, as [start, end) ranges
+	std::vector<std::pair<uintptr_t, uintptr_t>> root_stacks;
+	std::mutex remember_lock;
+
+	//Bytes allocated since the last collection, buffers counting as a whole when reserved
+	size_t bytes_since_gc;
+	//Collect once bytes_since_gc gets there
+	size_t gc_budget;
+	//Bytes marked by the last full collection, and by the last collection of any kind
+	size_t full_gc_live_size;
+	size_t live_size;
+	//Not searched by the small object allocator, see LARGE_OBJECT_SIZE
+	std::list<large_object> large_objects;
+	page_map<large_object> large_object_map;
+	//Total size of the large objects
+	size_t large_object_size;
+
+	//Old objects that may hold references to young objects
+	std::vector<core_representation*> remembered_set;
+
+	//Set while marking for a compacting collection
+	bool pin_roots;
+
+	//Marking threads besides the collecting one, null for single threaded marking
+	std::unique_ptr<gc_worker_pool> workers;
+	//One per marking thread
+	std::unique_ptr<mark_stack[]> mark_stacks;
+	//Marking threads that ran out of work, marking is over when all of them are
+	std::atomic<size_t> idle_markers;
+
+	//Set from the initial mark pause to the remark pause of a concurrent collection
+	bool concurrent_marking;
+	std::thread marker_thread;
+	//The marker ran out of work, so the remark pause can be short
+	std::atomic<bool> marker_idle;
+	std::atomic<bool> marker_stop;
+	//Overwritten references handed to the marker by the threads
+	std::vector<core_representation*> satb_queue;
+	std::mutex satb_lock;
+	std::condition_variable satb_ready;
+
+	gc_heap& add_heap(size_t size);
+	gc_heap& add_heap(gc_heap&& heap);
+	bool grow_heap(size_t size);
+	bool within_heap_limit(size_t size) const;
+	void collect_for_alloc();
+	bool refill_alloc_buffer(alloc_buffer& buffer, size_t size);
+	void retire_alloc_buffer(alloc_buffer& buffer);
+	void retire_alloc_buffers();
+	void* try_alloc_in_heaps(size_t size, bool is_gc_object);
+	void* try_alloc_or_refill(size_t size, bool is_gc_object);
+	void* alloc_slow(size_t size, bool is_gc_object);
+	void* alloc_large(size_t size, bool is_gc_object);
+
+	inline void* bump_alloc(alloc_buffer& buffer, size_t size, bool is_gc_object) {
+		size_t block_count = div_round_up(size, HEAP_UNIT_SIZE);
+		if (block_count == 0) {
+			block_count = 1;
+		}
+		if (block_count > buffer.limit - buffer.cursor) {
+			return nullptr;
+		}
+
+		size_t start = buffer.cursor;
+		buffer.cursor += block_count;
+		if (is_gc_object) {
+			//Buffers of other threads may share the word
+			buffer.heap->heap_starts.atomic_set(start);
+		}
+		return buffer.heap->heap_aligned + start * HEAP_UNIT_SIZE;
+	}
+
+	void lock_heap();
+	void stop_at_safepoint();
+	void stop_the_world();
+	void resume_the_world();
+	void collect_stack_roots(uintptr_t stack_pos);
+
+	static inline double seconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	gc_stats current_stats() const;
+
+	void collect(bool full);
+	void prepare_collection(bool full);
+	void finish_collection(bool full);
+	void mark(bool full);
+	void reset_marks(bool full);
+	void mark_roots(size_t index, size_t thread_count, bool full);
+	void drain_mark_stack(size_t index, size_t thread_count);
+	bool steal_mark_work(size_t index, size_t thread_count);
+	void mark_conservative_region(uintptr_t start, uintptr_t end,
+			mark_stack& pending_list);
+	//Marks object and pushes it to be traced, unless it was marked already
+	void mark(core_representation* object, mark_stack& pending_list);
+	//Addresses outside the heaps and large objects are never collected, so they count as marked
+	inline bool is_marked(core_representation* object) const {
+		const gc_heap* heap = heap_map.get(object);
+		if (!heap) {
+			const large_object* large = large_object_map.get(object);
+			return !large || __atomic_load_n(&large->marked, __ATOMIC_RELAXED);
+		}
+		return heap->mark_bits.atomic_get(((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE);
+	}
+	void mark_children(core_representation* object, mark_stack& pending_list);
+	void mark_extent(void* start, size_t size);
 	void mark_fields(const class_type* cls, core_representation* object,
-			std::queue<core_representation*>& pending_list);
-	void mark_field(const field& field, core_representation* object,
-			std::queue<core_representation*>& pending_list);
+			mark_stack& pending_list);
 	void mark_array(const type_info* content_type, core_representation* object,
-			std::queue<core_representation*>& pending_list);
-	void sweep();
+			mark_stack& pending_list);
+	void compact();
+	void compute_forwarding(gc_heap& heap);
+	void update_references(core_representation* object);
+	void move_objects(gc_heap& heap);
+	inline core_representation* forwarded(core_representation* object) const {
+		gc_heap* heap = heap_map.get(object);
+		if (!heap || heap->forwarding.empty()) {
+			return object;
+		}
+		uint32_t target = heap->forwarding[((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE];
+		if (target == NOT_FORWARDED) {
+			return object;
+		}
+		return (core_representation*) (heap->heap_aligned + target * HEAP_UNIT_SIZE);
+	}
+
+	void start_concurrent_mark();
+	void finish_concurrent_mark();
+	void stop_concurrent_marker();
+	void concurrent_mark_loop();
+	void flush_satb_buffer();
+
+	/**
+	 * Snapshot at the beginning: while marking concurrently, whatever a store overwrites
+	 * is traced, so everything reachable when marking started gets marked.
+	 */
+	inline void satb_barrier(core_representation* old_value) {
+		if (concurrent_marking && old_value && !is_marked(old_value)) {
+			std::vector<core_representation*>& satb_buffer = current_thread()->satb_buffer;
+			satb_buffer.push_back(old_value);
+			if (satb_buffer.size() >= SATB_BUFFER_SIZE) {
+				flush_satb_buffer();
+			}
+		}
+	}
+
+	bool write_heap_dump(const std::string& path);
+	bool write_image(const std::string& path);
+
+	void sweep(bool full);
+	void sweep_heap(gc_heap& heap);
+	void finish_sweep();
+	void sweep_large_objects();
+
+	void remember(core_representation* object);
+	void forget_remembered_set();
+
+	/**
+	 * Objects that survived a collection stay marked, young ones are not.
+	 * Only old objects storing a reference to a young one need remembering.
+	 */
+	inline void write_barrier(core_representation* object, core_representation* value) {
+		if (config.generational && value && is_marked(object) && !is_marked(value)) {
+			remember(object);
+		}
+	}
 public:
-	gc_context(std::unique_ptr<gc_type_store> type_store, void* stack_start);
+	//The calling thread gets registered with stack_start
+	gc_context(std::unique_ptr<gc_type_store> type_store, void* stack_start,
+			const gc_config& config = gc_config());
+	~gc_context();
+
+	/**
+	 * Every thread but the one that created the context must be registered before it
+	 * touches the heap, and unregistered before it exits. stack_start is the highest stack
+	 * address to scan, as given to the constructor. A thread may be registered with
+	 * several contexts at once.
+	 * Collections stop all registered threads. They stop when they allocate or call
+	 * safepoint(), so threads that run for long without allocating should call it now
+	 * and then, and wrap anything that may block in blocking_call.
+	 */
+	void register_thread(void* stack_start);
+	void unregister_thread();
+
+	inline void safepoint() {
+		if (safepoint_requested.load(std::memory_order_relaxed)) {
+			stop_at_safepoint();
+		}
+	}
+
+	//Runs call with the thread counted as stopped, so call must not touch the heap
+	void blocking_call(const std::function<void()>& call);
 
 	size_t count_heaps() { return heaps.size(); }
+	gc_type_store* get_type_store() { return type_store.get(); }
+	const std::vector<double>& get_pause_times() const { return pause_times; }
+	gc_stats get_stats();
+	std::vector<gc_heap_stats> get_heap_stats();
+
+	/**
+	 * See gc_callback. Both are called from the thread that collects, with full set for
+	 * full collections. Pass nullptr to remove one.
+	 */
+	void set_pre_gc_callback(const gc_callback& callback);
+	void set_post_gc_callback(const gc_callback& callback);
 	gc_heap* find_owner_heap(void* content_location, bool is_gc_object);
 	const gc_heap* find_owner_heap(void* content_location, bool is_gc_object) const;
+	large_object* find_large_object(void* content_location, bool is_gc_object);
+	const large_object* find_large_object(void* content_location, bool is_gc_object) const;
+
+	inline core_representation* alloc_class(type_info* type) {
+		class_type* cls = ((class_type_info*) type)->cls;
+
+		size_t class_size = cls->computed_size;
 
-	core_representation* alloc_class(type_info* class_type);
+		core_representation* repr = (core_representation*) alloc(class_size, true);
+		std::memset(repr, 0, class_size);
+		set_object_type(repr, type);
+
+		return repr;
+	}
 	array_representation* alloc_array(type_info* inner_type, size_t length);
 
 	//Tries to allocate, but does not trigger GC nor allocates new space
 	void* try_alloc(size_t size, bool is_gc_object);
 
-	void* alloc(size_t size, bool is_gc_object);
+	inline void* alloc(size_t size, bool is_gc_object) {
+		safepoint();
+
+		void* chunk = bump_alloc(current_thread()->buffer, size, is_gc_object);
+		if (!chunk) {
+			chunk = alloc_slow(size, is_gc_object);
+		}
+		if (concurrent_marking) {
+			//Allocate black, the marker never looks at new objects
+			mark_extent(chunk, size);
+		}
+		return chunk;
+	}
+
+
+	/**
+	 * Reference accessors. With generational collection or concurrent marking enabled,
+	 * every reference store into a heap object must go through store_field or store_element.
+	 * Static fields are roots, so they don't need barriers, but they hold a reference_t like
+	 * any other reference slot, so load_static and store_static encode them.
+	 */
+	inline core_representation* load_field(core_representation* object, const field& field) const {
+		return decode_reference(*((reference_t*) ((char*) object + field.field_offset)));
+	}
+	inline void store_field(core_representation* object, const field& field, core_representation* value) {
+		reference_t* slot = (reference_t*) ((char*) object + field.field_offset);
+		satb_barrier(decode_reference(*slot));
+		store_reference(slot, value);
+		write_barrier(object, value);
+	}
+	inline core_representation* load_element(array_representation* array, size_t index) const {
+		return decode_reference(((reference_t*) array->content())[index]);
+	}
+	inline void store_element(array_representation* array, size_t index, core_representation* value) {
+		reference_t* slot = &((reference_t*) array->content())[index];
+		satb_barrier(decode_reference(*slot));
+		store_reference(slot, value);
+		write_barrier(&array->core, value);
+	}
+	inline core_representation* load_static(const class_type* cls, const field& field) const {
+		return decode_reference(*((reference_t*) ((char*) cls->static_field_data + field.field_offset)));
+	}
+	inline void store_static(class_type* cls, const field& field, core_representation* value) {
+		*((reference_t*) ((char*) cls->static_field_data + field.field_offset)) = encode_reference(value);
+	}
 
 	bool is_heap_object(void* obj) const;
+	size_t total_heap_size() const;
+
+	//Adds a heap of at least size bytes, so that it can be filled without triggering a GC
+	void reserve_heap(size_t size);
 
 	void prepare_static_fields();
 
+	/**
+	 * When enabled (the default), heaps are only swept right before they are
+	 * allocated from, instead of all at once at the end of each collection.
+	 */
+	void set_lazy_sweep(bool enabled) { config.lazy_sweep = enabled; }
+
+	/**
+	 * When enabled, allocations first trigger minor collections, which only trace young
+	 * objects (allocated since the last collection) from the roots and the remembered set,
+	 * and promote the survivors. Full collections only happen once the survivors promoted
+	 * since the last one exceed the allocation budget, or when the heap is at its limit.
+	 */
+	void set_generational(bool enabled);
+
+	/**
+	 * When enabled, full collections slide live objects towards the start of their heap.
+	 * References in objects, arrays and static fields are updated. Objects referenced from
+	 * the stack are pinned, as are non GC blocks (static field data).
+	 */
+	void set_compaction(bool enabled) { config.compaction = enabled; }
+
+	/**
+	 * Runs a full collection, then writes every live object, its outgoing references, and
+	 * the roots to path, in the format of gc_dump.h. Returns false if the file can't be written.
+	 */
+	bool dump_heap(const std::string& path);
+
+	/**
+	 * Writes the type store, the static field data and every object reachable from the
+	 * static fields to path, in the format of gc_image.h. Returns false if the file can't
+	 * be written, or if a type refers to a class that was not pushed to the type store.
+	 */
+	bool save_image(const std::string& path);
+
+	/**
+	 * Creates a context with the types, static fields and objects of an image written by
+	 * save_image, with the same pointer size and HEAP_UNIT_SIZE. The objects get a heap of
+	 * their own, mapped from the file, and the static field data is in it, so
+	 * prepare_static_fields must not be called. Returns null if the image can't be used,
+	 * which includes a truncated file and any record, size or reference out of range.
+	 */
+	static std::unique_ptr<gc_context> load_image(const std::string& path, void* stack_start,
+			const gc_config& config = gc_config());
+
+	//Full collection
 	void perform_gc();
+	//Young generation only when generational, full collection otherwise
+	void perform_minor_gc();
 };
 
 #endif /* CORE_H_ */
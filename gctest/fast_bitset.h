@@ -5,13 +5,73 @@
 #include <vector>
 #include <limits>
 #include <utility>
+#include <algorithm>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 class fast_bitset {
 	size_t bitcount;
-	std::vector<uint32_t> bits;
+	std::vector<uint64_t> bits;
+
+	static const uint64_t ALL_SET = ~uint64_t(0);
+
+	//Index of the first word in [word, end_word) that is not equal to skipped, or end_word
+	inline size_t skip_words(size_t word, size_t end_word, uint64_t skipped) const {
+		const uint64_t* data = bits.data();
+#if defined(__AVX2__)
+		__m256i pattern = _mm256_set1_epi64x(skipped);
+		for (; word + 4 <= end_word; word += 4) {
+			__m256i chunk = _mm256_loadu_si256((const __m256i*) (data + word));
+			if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(chunk, pattern)) != -1) {
+				break;
+			}
+		}
+#elif defined(__SSE2__)
+		__m128i pattern = _mm_set1_epi32(int(uint32_t(skipped)));
+		for (; word + 2 <= end_word; word += 2) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*) (data + word));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(chunk, pattern)) != 0xFFFF) {
+				break;
+			}
+		}
+#endif
+		while (word < end_word && data[word] == skipped) {
+			++word;
+		}
+		return word;
+	}
+
+	//Shared by find_next_set and find_next_unset: flip is 0 to look for set bits, ALL_SET for unset bits
+	inline size_t find_next(size_t start, size_t max_hint, uint64_t flip) const {
+		if (start >= bitcount) {
+			return bitcount;
+		}
+		size_t limit = max_hint < bitcount - start ? start + max_hint : bitcount;
+
+		size_t word = start >> 6;
+		size_t end_word = (limit + 63) >> 6;
+		uint64_t current = (bits[word] ^ flip) & (ALL_SET << (start & 63));
+		while (current == 0) {
+			word = skip_words(word + 1, end_word, flip);
+			if (word >= end_word) {
+				return bitcount;
+			}
+			current = bits[word] ^ flip;
+		}
+
+		size_t idx = (word << 6) + __builtin_ctzll(current);
+		return idx < limit ? idx : bitcount;
+	}
+
+	//Bits [start & 63, (start & 63) + length) of one word, length <= 64 and within the word
+	static inline uint64_t word_mask(size_t start, size_t length) {
+		uint64_t mask = length == 64 ? ALL_SET : ((uint64_t(1) << length) - 1);
+		return mask << (start & 63);
+	}
 public:
 	inline fast_bitset() : bitcount(0) {}
-	inline fast_bitset(size_t bitcount) : bitcount(bitcount), bits((bitcount + 31) >> 5) {}
+	inline fast_bitset(size_t bitcount) : bitcount(bitcount), bits((bitcount + 63) >> 6) {}
 	inline fast_bitset(const fast_bitset& other) : bitcount(other.bitcount), bits(other.bits) {}
 	inline fast_bitset(fast_bitset&& other) : bitcount(other.bitcount), bits(std::move(other.bits)) {}
 
@@ -23,123 +83,92 @@ public:
 	}
 
 	inline size_t size() const { return bitcount; }
-	inline bool get(size_t idx) const { return bits[idx >> 5] & (1 << (idx & 31)); }
-	inline void set(size_t idx) { bits[idx >> 5] |= (1 << (idx & 31)); }
-	inline void unset(size_t idx) { bits[idx >> 5] &= ~(1 << (idx & 31)); }
-
+	//The bits in words of 64, bit i being bit i % 64 of word i / 64
+	inline size_t word_count() const { return bits.size(); }
+	inline uint64_t word(size_t index) const { return bits[index]; }
+	inline void clear() { std::fill(bits.begin(), bits.end(), 0); }
+	inline bool get(size_t idx) const { return bits[idx >> 6] & (uint64_t(1) << (idx & 63)); }
+	inline void set(size_t idx) { bits[idx >> 6] |= (uint64_t(1) << (idx & 63)); }
+	inline void unset(size_t idx) { bits[idx >> 6] &= ~(uint64_t(1) << (idx & 63)); }
+
+	//First set bit in [start, start + max_hint), or size() if there is none
 	inline size_t find_next_set(size_t start, size_t max_hint) const {
-		//First, we align the start
-		while ((start & 31) != 0 && max_hint > 0) {
-			if (start >= size() || get(start)) {
-				return start;
-			}
-			++start;
-			--max_hint;
-		}
-
-		//Aligned, now mass check
-		while (start < size() && max_hint > 0) {
-			if (bits[start >> 5] == 0x00000000) { //Quickly rule out empty spaces
-				start += 32;
-				if (max_hint < 32) {
-					//We exceeded the limit
-					return size();
-				}
-				max_hint -= 32;
-			}
-			else { //Manual check
-				for (int i = 0; i < 32; ++i) {
-					if (max_hint == 0) {
-						//We exceeded the limit
-						return size();
-					}
-
-					if (get(start)) {
-						return start;
-					}
-					++start;
-					--max_hint;
-				}
-			}
-		}
-
-		return size();
+		return find_next(start, max_hint, 0);
 	}
 
+	//First unset bit in [start, start + max_hint), or size() if there is none
 	inline size_t find_next_unset(size_t start, size_t max_hint) const {
-		//First, we align the start
-		while ((start & 31) != 0 && max_hint > 0) {
-			if (start >= size() || !get(start)) {
-				return start;
-			}
-			++start;
-			--max_hint;
-		}
+		return find_next(start, max_hint, ALL_SET);
+	}
 
-		//Aligned, now mass check
-		while (start < size() && max_hint > 0) {
-			if (bits[start >> 5] == 0xFFFFFFFF) { //Quickly rule out empty spaces
-				start += 32;
-				if (max_hint < 32) {
-					//We exceeded the limit
-					return size();
-				}
-				max_hint -= 32;
+	//Start of the first run of length unset bits at or after start, or size() if there is none
+	inline size_t find_unset_run(size_t start, size_t length) const {
+		for (;;) {
+			start = find_next_unset(start, bitcount);
+			if (bitcount - start < length) {
+				return bitcount;
 			}
-			else { //Manual check
-				for (int i = 0; i < 32; ++i) {
-					if (max_hint == 0) {
-						//We exceeded the limit
-						return size();
-					}
-
-					if (!get(start)) {
-						return start;
-					}
-					++start;
-					--max_hint;
-				}
+
+			size_t run_end = find_next_set(start, length);
+			if (run_end == bitcount) {
+				return start;
 			}
+			start = run_end;
 		}
-
-		return size();
 	}
 
-	inline void unset_range(size_t start, size_t length) {
-		//First we align the start
-		while ((start & 31) != 0 && length > 0) {
-			unset(start++);
-			--length;
+	//Number of set bits
+	inline size_t count() const {
+		size_t total = 0;
+		for (uint64_t word : bits) {
+			total += __builtin_popcountll(word);
 		}
+		return total;
+	}
 
-		while (length >= 32) {
-			bits[start >> 5] = 0;
-			length -= 32;
-			start += 32;
+	//Keeps only the bits that are also set in other, which must have the same size
+	inline void and_with(const fast_bitset& other) {
+		for (size_t i = 0; i < bits.size(); ++i) {
+			bits[i] &= other.bits[i];
 		}
+	}
 
+	inline void unset_range(size_t start, size_t length) {
 		while (length > 0) {
-			unset(start++);
-			--length;
+			size_t chunk = std::min(length, 64 - (start & 63));
+			bits[start >> 6] &= ~word_mask(start, chunk);
+			start += chunk;
+			length -= chunk;
 		}
 	}
 
 	inline void set_range(size_t start, size_t length) {
-		//First we align the start
-		while ((start & 31) != 0 && length > 0) {
-			set(start++);
-			--length;
-		}
-
-		while (length >= 32) {
-			bits[start >> 5] = 0xFFFFFFFF;
-			length -= 32;
-			start += 32;
+		while (length > 0) {
+			size_t chunk = std::min(length, 64 - (start & 63));
+			bits[start >> 6] |= word_mask(start, chunk);
+			start += chunk;
+			length -= chunk;
 		}
+	}
 
+	//Same as set and set_range, but safe when other threads set bits in the same words
+	inline bool atomic_get(size_t idx) const {
+		return __atomic_load_n(&bits[idx >> 6], __ATOMIC_RELAXED) & (uint64_t(1) << (idx & 63));
+	}
+	//Returns whether the bit was already set
+	inline bool atomic_test_and_set(size_t idx) {
+		uint64_t mask = uint64_t(1) << (idx & 63);
+		return __atomic_fetch_or(&bits[idx >> 6], mask, __ATOMIC_RELAXED) & mask;
+	}
+	inline void atomic_set(size_t idx) {
+		__atomic_fetch_or(&bits[idx >> 6], uint64_t(1) << (idx & 63), __ATOMIC_RELAXED);
+	}
+	inline void atomic_set_range(size_t start, size_t length) {
 		while (length > 0) {
-			set(start++);
-			--length;
+			size_t chunk = std::min(length, 64 - (start & 63));
+			__atomic_fetch_or(&bits[start >> 6], word_mask(start, chunk), __ATOMIC_RELAXED);
+			start += chunk;
+			length -= chunk;
 		}
 	}
 };
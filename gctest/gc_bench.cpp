@@ -0,0 +1,190 @@
+#include "core.h"
+#include "gc_bench.h"
+#include <iostream>
+#include <chrono>
+#include <cstring>
+
+using std::cout;
+using std::endl;
+using std::unique_ptr;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+//Overwrites the dead stack below the caller, so that stale pointers left there are not
+//treated as roots by the conservative stack scan.
+static void __attribute__((noinline)) clear_stack() {
+	volatile char area[0x4000];
+	std::memset((char*) area, 0, sizeof(area));
+}
+
+static void __attribute__((noinline)) fill_with_nodes(gc_context& ctx, type_info* node_type,
+		size_t onext, size_t count) {
+	void* head = nullptr;
+	for (size_t i = 0; i < count; ++i) {
+		void* node = ctx.alloc_class(node_type);
+		*((reference_t*) ((char*) node + onext)) = encode_reference((core_representation*) head);
+		head = node;
+	}
+}
+
+static void bench_sweep() {
+	gc_type_store* type_store = new gc_type_store();
+
+	class_type bench_Node;
+	bench_Node.full_name = "bench.Node";
+	bench_Node.base_type = nullptr;
+	bench_Node.owned_type = nullptr;
+	type_store->push_class_type(&bench_Node);
+
+	field bench_Node_next;
+	bench_Node_next.type = type_store->get_class_type(&bench_Node);
+	bench_Node_next.flags.is_static = 0;
+	bench_Node.fields.push_back(bench_Node_next);
+
+	type_store->compute_sizes();
+	type_store->compute_static_sizes();
+
+	gc_context ctx(unique_ptr<gc_type_store>(type_store), get_stack_pointer());
+	ctx.set_lazy_sweep(false);
+
+	//A single big heap full of objects that are all dead by the time we collect
+	const size_t heap_size = 64 << 20;
+	ctx.reserve_heap(heap_size);
+	size_t node_count = heap_size / align(bench_Node.computed_size, HEAP_UNIT_SIZE) - 1;
+	fill_with_nodes(ctx, type_store->get_class_type(&bench_Node),
+			bench_Node.fields[0].field_offset, node_count);
+	clear_stack();
+
+	//Only the sweep phase, the roots and the mark are timed separately
+	ctx.perform_gc();
+	double elapsed = ctx.get_stats().last_phases.sweep;
+
+	double swept_bytes = double(ctx.total_heap_size());
+	cout << "sweep: " << (swept_bytes / (1 << 20)) << " MB, "
+			<< (elapsed * 1000) << " ms, "
+			<< (swept_bytes / elapsed / 1e9) << " GB/s" << endl;
+}
+
+//A complete binary tree of the given depth, built depth first
+static core_representation* build_tree(gc_context& ctx, type_info* node_type,
+		const field& left, const field& right, size_t depth) {
+	core_representation* node = ctx.alloc_class(node_type);
+	if (depth > 1) {
+		ctx.store_field(node, left, build_tree(ctx, node_type, left, right, depth - 1));
+		ctx.store_field(node, right, build_tree(ctx, node_type, left, right, depth - 1));
+	}
+	return node;
+}
+
+//Best of a few full collections, the first one also pays for page faults in the mark bitmaps
+static double best_gc_time(gc_context& ctx) {
+	double best = 0;
+	for (int i = 0; i < 5; ++i) {
+		steady_clock::time_point start = steady_clock::now();
+		ctx.perform_gc();
+		duration<double> elapsed = steady_clock::now() - start;
+		if (i == 0 || elapsed.count() < best) {
+			best = elapsed.count();
+		}
+	}
+	return best;
+}
+
+//stack_start must belong to a caller, so that the tree root in our frame gets scanned
+static void bench_parallel_mark(void* stack_start, size_t thread_count) {
+	gc_type_store* type_store = new gc_type_store();
+
+	class_type bench_Tree;
+	bench_Tree.full_name = "bench.Tree";
+	bench_Tree.base_type = nullptr;
+	bench_Tree.owned_type = nullptr;
+	type_store->push_class_type(&bench_Tree);
+
+	field bench_Tree_left;
+	bench_Tree_left.type = type_store->get_class_type(&bench_Tree);
+	bench_Tree_left.flags.is_static = 0;
+	bench_Tree.fields.push_back(bench_Tree_left);
+
+	field bench_Tree_right;
+	bench_Tree_right.type = type_store->get_class_type(&bench_Tree);
+	bench_Tree_right.flags.is_static = 0;
+	bench_Tree.fields.push_back(bench_Tree_right);
+
+	type_store->compute_sizes();
+	type_store->compute_static_sizes();
+
+	//2^21 - 1 nodes, all alive, in a heap big enough not to collect while building
+	const size_t depth = 21;
+	gc_config config;
+	config.mark_threads = thread_count;
+	config.min_heap_size = (size_t(1) << depth) * align(bench_Tree.computed_size, HEAP_UNIT_SIZE);
+	gc_context ctx(unique_ptr<gc_type_store>(type_store), stack_start, config);
+
+	core_representation* volatile root = build_tree(ctx, type_store->get_class_type(&bench_Tree),
+			bench_Tree.fields[0], bench_Tree.fields[1], depth);
+	clear_stack();
+
+	double best = best_gc_time(ctx);
+	(void) root;
+
+	cout << "mark: " << thread_count << " threads, " << ((size_t(1) << depth) - 1) << " objects, "
+			<< (best * 1000) << " ms" << endl;
+}
+
+//A linked list, which gives the mark stack no parallelism at all, and an array holding
+//as many unconnected objects, which gives it a lot
+static void bench_mark_shapes(void* stack_start) {
+	gc_type_store* type_store = new gc_type_store();
+
+	class_type bench_Node;
+	bench_Node.full_name = "bench.Node";
+	bench_Node.base_type = nullptr;
+	bench_Node.owned_type = nullptr;
+	type_store->push_class_type(&bench_Node);
+
+	field bench_Node_next;
+	bench_Node_next.type = type_store->get_class_type(&bench_Node);
+	bench_Node_next.flags.is_static = 0;
+	bench_Node.fields.push_back(bench_Node_next);
+
+	type_store->compute_sizes();
+	type_store->compute_static_sizes();
+
+	const size_t count = size_t(1) << 21;
+	type_info* node_type = type_store->get_class_type(&bench_Node);
+	const field& next = bench_Node.fields[0];
+	gc_config config;
+	config.min_heap_size = 2 * count * align(bench_Node.computed_size, HEAP_UNIT_SIZE);
+	gc_context ctx(unique_ptr<gc_type_store>(type_store), stack_start, config);
+
+	core_representation* volatile list = nullptr;
+	for (size_t i = 0; i < count; ++i) {
+		core_representation* node = ctx.alloc_class(node_type);
+		ctx.store_field(node, next, list);
+		list = node;
+	}
+	clear_stack();
+	double list_time = best_gc_time(ctx);
+	list = nullptr;
+
+	array_representation* volatile array = ctx.alloc_array(node_type, count);
+	for (size_t i = 0; i < count; ++i) {
+		ctx.store_element(array, i, ctx.alloc_class(node_type));
+	}
+	clear_stack();
+	double array_time = best_gc_time(ctx);
+	(void) array;
+
+	cout << "mark list: " << count << " objects, " << (list_time * 1000) << " ms" << endl;
+	cout << "mark array: " << count << " objects, " << (array_time * 1000) << " ms" << endl;
+}
+
+void run_benchmarks() {
+	bench_sweep();
+	bench_mark_shapes(get_stack_pointer());
+
+	const size_t thread_counts[] = { 1, 2, 4, 8 };
+	for (size_t thread_count : thread_counts) {
+		bench_parallel_mark(get_stack_pointer(), thread_count);
+	}
+}
@@ -0,0 +1,7 @@
+#ifndef GC_BENCH_H_
+#define GC_BENCH_H_
+
+//Microbenchmarks, run with the --bench command line argument
+void run_benchmarks();
+
+#endif /* GC_BENCH_H_ */
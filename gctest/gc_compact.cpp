@@ -0,0 +1,163 @@
+#include "core.h"
+#include "utils.h"
+#include <cstring>
+
+using std::memmove;
+
+void gc_context::compact() {
+	bool any_moved = false;
+	for (gc_heap& heap : heaps) {
+		compute_forwarding(heap);
+		any_moved |= !heap.forwarding.empty();
+	}
+	if (!any_moved) {
+		return;
+	}
+
+	//Static fields
+	for (class_type* cls : type_store->class_types) {
+		if (cls->static_size == 0) {
+			continue;
+		}
+
+		for (size_t offset : cls->static_reference_offsets) {
+			reference_t* slot = (reference_t*) ((char*) cls->static_field_data + offset);
+			if (*slot) {
+				*slot = encode_reference(forwarded(decode_reference(*slot)));
+			}
+		}
+	}
+
+	//Every live object, including those that won't move
+	for (gc_heap& heap : heaps) {
+		size_t bitcount = heap.heap_starts.size();
+		for (size_t i = heap.heap_starts.find_next_set(0, bitcount); i < bitcount;
+				i = heap.heap_starts.find_next_set(i + 1, bitcount)) {
+			if (heap.mark_bits.get(i)) {
+				update_references((core_representation*) (heap.heap_aligned + i * HEAP_UNIT_SIZE));
+			}
+		}
+	}
+
+	for (large_object& object : large_objects) {
+		if (object.is_gc_object && object.marked) {
+			update_references((core_representation*) object.start);
+		}
+	}
+
+	for (gc_heap& heap : heaps) {
+		move_objects(heap);
+	}
+}
+
+void gc_context::compute_forwarding(gc_heap& heap) {
+	size_t bitcount = heap.heap_starts.size();
+	size_t live_blocks = heap.mark_bits.count();
+	if (live_blocks == 0 || live_blocks > bitcount - bitcount / COMPACTION_MIN_FREE_DIVISOR) {
+		//Nothing to move, or too little space to gain for the copying
+		return;
+	}
+
+	//Blocks that stay where they are: pinned objects and non GC blocks
+	fast_bitset fixed(heap.mark_bits);
+	bool any_movable = false;
+	for (size_t i = heap.heap_starts.find_next_set(0, bitcount); i < bitcount;
+			i = heap.heap_starts.find_next_set(i + 1, bitcount)) {
+		if (heap.mark_bits.get(i) && !heap.pinned_bits.get(i)) {
+			core_representation* object = (core_representation*) (heap.heap_aligned + i * HEAP_UNIT_SIZE);
+			fixed.unset_range(i, div_round_up(type_store->measure_object_size(object), HEAP_UNIT_SIZE));
+			any_movable = true;
+		}
+	}
+
+	if (!any_movable) {
+		return;
+	}
+
+	heap.forwarding.assign(bitcount, NOT_FORWARDED);
+
+	//Slide each object to the first hole after the previous one that has no fixed blocks.
+	//The object's own blocks are such a hole, so objects never move up.
+	bool any_moved = false;
+	size_t next_free = 0;
+	for (size_t i = heap.heap_starts.find_next_set(0, bitcount); i < bitcount;
+			i = heap.heap_starts.find_next_set(i + 1, bitcount)) {
+		if (!heap.mark_bits.get(i) || heap.pinned_bits.get(i)) {
+			continue;
+		}
+
+		core_representation* object = (core_representation*) (heap.heap_aligned + i * HEAP_UNIT_SIZE);
+		size_t block_count = div_round_up(type_store->measure_object_size(object), HEAP_UNIT_SIZE);
+		size_t target = fixed.find_unset_run(next_free, block_count);
+		if (target != i) {
+			heap.forwarding[i] = uint32_t(target);
+			any_moved = true;
+		}
+		next_free = target + block_count;
+	}
+
+	if (!any_moved) {
+		heap.forwarding.clear();
+		return;
+	}
+
+	//Objects may slide over dead ones that are not swept yet. Their starts must go now,
+	//or they would survive the sweep in the middle of a live object.
+	heap.heap_starts.and_with(heap.mark_bits);
+}
+
+void gc_context::update_references(core_representation* object) {
+	type_info* type = object_type(object);
+	if (type->type_category == TYPE_CLASS_OBJECT) {
+		const class_type* cls = ((class_type_info*) type)->cls;
+		for (const reference_range& range : cls->reference_ranges) {
+			reference_t* slots = (reference_t*) ((char*) object + range.offset);
+			for (size_t i = 0; i < range.count; ++i) {
+				if (slots[i]) {
+					slots[i] = encode_reference(forwarded(decode_reference(slots[i])));
+				}
+			}
+		}
+	}
+	else if (type->type_category == TYPE_ARRAY) {
+		array_representation* array = (array_representation*) object;
+		type_category_t content_category = ((array_type_info*) type)->content_type->type_category;
+		if (content_category == TYPE_ARRAY || content_category == TYPE_CLASS_OBJECT) {
+			reference_t* elements = (reference_t*) array->content();
+			for (size_t i = 0; i < array->array_length; ++i) {
+				if (elements[i]) {
+					elements[i] = encode_reference(forwarded(decode_reference(elements[i])));
+				}
+			}
+		}
+	}
+}
+
+void gc_context::move_objects(gc_heap& heap) {
+	if (heap.forwarding.empty()) {
+		return;
+	}
+
+	//Targets are always below their source, so going up never overwrites an object
+	//that still has to move
+	size_t bitcount = heap.heap_starts.size();
+	for (size_t i = heap.heap_starts.find_next_set(0, bitcount); i < bitcount;
+			i = heap.heap_starts.find_next_set(i + 1, bitcount)) {
+		uint32_t target = heap.forwarding[i];
+		if (target == NOT_FORWARDED) {
+			continue;
+		}
+
+		core_representation* object = (core_representation*) (heap.heap_aligned + i * HEAP_UNIT_SIZE);
+		size_t block_count = div_round_up(type_store->measure_object_size(object), HEAP_UNIT_SIZE);
+		memmove(heap.heap_aligned + target * HEAP_UNIT_SIZE, object, block_count * HEAP_UNIT_SIZE);
+
+		heap.heap_starts.unset(i);
+		heap.heap_starts.set(target);
+		heap.mark_bits.unset_range(i, block_count);
+		heap.mark_bits.set_range(target, block_count);
+	}
+
+	heap.forwarding.clear();
+	heap.forwarding.shrink_to_fit();
+}
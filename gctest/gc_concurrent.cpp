@@ -0,0 +1,115 @@
+#include "core.h"
+
+using std::mutex;
+using std::unique_lock;
+using std::lock_guard;
+
+void gc_context::start_concurrent_mark() {
+	//Initial mark pause: only the roots are scanned here
+	__builtin_unwind_init();
+	stop_the_world();
+	collect_stack_roots(uintptr_t(get_stack_pointer()));
+
+	prepare_collection(true);
+
+	pin_roots = false;
+	reset_marks(true);
+	mark_roots(0, 1, true);
+
+	concurrent_marking = true;
+	marker_idle.store(false);
+	marker_stop.store(false);
+
+	marker_thread = std::thread(&gc_context::concurrent_mark_loop, this);
+	resume_the_world();
+}
+
+void gc_context::finish_concurrent_mark() {
+	//Remark pause: whatever the marker didn't get to is traced here
+	stop_the_world();
+	stop_concurrent_marker();
+	std::chrono::steady_clock::time_point remark_start = std::chrono::steady_clock::now();
+
+	mark_stack& objects_to_mark = mark_stacks[0];
+	for (gc_thread& thread : threads) {
+		for (core_representation* object : thread.satb_buffer) {
+			mark(object, objects_to_mark);
+		}
+		thread.satb_buffer.clear();
+	}
+	for (core_representation* object : satb_queue) {
+		mark(object, objects_to_mark);
+	}
+	satb_queue.clear();
+
+	//Also takes back what was published, in case mark_threads enabled sharing
+	do {
+		core_representation* object;
+		while (objects_to_mark.pop(object)) {
+			mark_children(object, objects_to_mark);
+		}
+	} while (objects_to_mark.steal_from(objects_to_mark));
+	stats.last_phases.mark += seconds_since(remark_start);
+
+	//Everything allocated from now on is young again
+	concurrent_marking = false;
+
+	//The rest of the buffers is unmarked, so they must not be in use during the sweep
+	retire_alloc_buffers();
+	finish_collection(true);
+	resume_the_world();
+}
+
+void gc_context::stop_concurrent_marker() {
+	{
+		lock_guard<mutex> guard(satb_lock);
+		marker_stop.store(true);
+	}
+	satb_ready.notify_one();
+	marker_thread.join();
+}
+
+void gc_context::concurrent_mark_loop() {
+	mark_stack& objects_to_mark = mark_stacks[0];
+
+	for (;;) {
+		do {
+			core_representation* object;
+			while (objects_to_mark.pop(object)) {
+				mark_children(object, objects_to_mark);
+
+				if (marker_stop.load(std::memory_order_relaxed)) {
+					//The remark pause takes over
+					return;
+				}
+			}
+		} while (objects_to_mark.steal_from(objects_to_mark));
+
+		unique_lock<mutex> guard(satb_lock);
+		while (satb_queue.empty() && !marker_stop.load()) {
+			marker_idle.store(true);
+			satb_ready.wait(guard);
+		}
+		if (marker_stop.load()) {
+			return;
+		}
+
+		marker_idle.store(false);
+		for (core_representation* object : satb_queue) {
+			mark(object, objects_to_mark);
+		}
+		satb_queue.clear();
+	}
+}
+
+void gc_context::flush_satb_buffer() {
+	std::vector<core_representation*>& satb_buffer = current_thread()->satb_buffer;
+	{
+		lock_guard<mutex> guard(satb_lock);
+		satb_queue.insert(satb_queue.end(), satb_buffer.begin(), satb_buffer.end());
+		//Not idle anymore, so that the remark pause doesn't start before the marker gets this
+		marker_idle.store(false);
+	}
+	satb_buffer.clear();
+	satb_ready.notify_one();
+}
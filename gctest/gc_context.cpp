@@ -4,69 +4,113 @@
 #include <utility>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <thread>
 
 using std::cout;
 using std::cerr;
 using std::endl;
-using std::queue;
 using std::string;
 using std::malloc;
 using std::memset;
 using std::move;
 using std::unique_ptr;
+using std::mutex;
+using std::lock_guard;
 
-gc_context::gc_context(unique_ptr<gc_type_store> type_store, void* stack_start) :
+gc_context::gc_context(unique_ptr<gc_type_store> type_store, void* stack_start,
+		const gc_config& config) :
 		type_store(move(type_store)),
-		stack_start(stack_start),
-		last_mark_id(0),
 		last_alloc_heap(0),
-		first_heap((char*) UINTPTR_MAX),
-		last_heap(nullptr) {
+		config(config),
+		safepoint_requested(false),
+		world_stops(0),
+		used_before_gc(0),
+		bytes_since_gc(0),
+		gc_budget(config.min_gc_budget),
+		full_gc_live_size(0),
+		live_size(0),
+		large_object_size(0),
+		pin_roots(false),
+		idle_markers(0),
+		concurrent_marking(false),
+		marker_idle(false),
+		marker_stop(false) {
+	register_thread(stack_start);
+
+	size_t thread_count = config.mark_threads > 0 ? config.mark_threads : 1;
+	mark_stacks.reset(new mark_stack[thread_count]);
+	if (thread_count > 1) {
+		workers.reset(new gc_worker_pool(thread_count));
+		for (size_t i = 0; i < thread_count; ++i) {
+			mark_stacks[i].set_sharing(true);
+		}
+	}
 
-}
+	if (config.min_heap_size > 0) {
+		reserve_heap(config.min_heap_size);
+	}
 
-core_representation* gc_context::alloc_class(type_info* type) {
-	class_type* cls = ((class_type_info*) type)->cls;
+}
 
-	size_t class_size = cls->computed_size;
+gc_context::~gc_context() {
+	if (concurrent_marking) {
+		stop_concurrent_marker();
+	}
 
-	core_representation* repr = (core_representation*) alloc(class_size, true);
-	memset(repr, 0, class_size);
-	repr->type = type;
-	repr->last_mark = last_mark_id;
+	//The heaps free themselves
+	for (large_object& object : large_objects) {
+		free_pages(object.start, object.size);
+	}
 
-	return repr;
+	//Only the running thread's registration can be dropped here; others unregister themselves
+	forget_current_thread();
 }
 
 array_representation* gc_context::alloc_array(type_info* content_type, size_t length) {
-	size_t content_size = type_store->measure_array_content_size(content_type, length);
-	void* content = alloc(content_size, false);
-
-	array_representation* repr = (array_representation*) alloc(sizeof(array_representation), true);
+	size_t size = type_store->measure_array_size(content_type, length);
+	array_representation* repr = (array_representation*) alloc(size, true);
+	if (size <= LARGE_OBJECT_SIZE) {
+		//Large objects get fresh pages, which are zeroed already
+		memset(repr->content(), 0, size - sizeof(array_representation));
+	}
+	set_object_type(&repr->core, type_store->get_type_array(content_type));
 	repr->array_length = length;
-	repr->content = content;
-	repr->core.type = type_store->get_type_array(content_type);
-	repr->core.last_mark = last_mark_id;
 
 	return repr;
 }
 
 void* gc_context::try_alloc(size_t size, bool is_gc_object) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	return try_alloc_in_heaps(size, is_gc_object);
+}
+
+void* gc_context::try_alloc_in_heaps(size_t size, bool is_gc_object) {
 	if (last_alloc_heap >= heaps.size()) {
 		last_alloc_heap = 0;
 	}
 	for (size_t aheap = last_alloc_heap; aheap < heaps.size(); ++aheap) {
 		gc_heap& heap = heaps[aheap];
+		if (heap.needs_sweep) {
+			sweep_heap(heap);
+		}
 		void* chunk = heap.try_alloc(size, is_gc_object);
 		if (chunk) {
+			heap.allocated_since_gc = true;
 			last_alloc_heap = aheap;
 			return chunk;
 		}
 	}
 	for (size_t aheap = 0; aheap < last_alloc_heap; ++aheap) {
 		gc_heap& heap = heaps[aheap];
+		if (heap.needs_sweep) {
+			sweep_heap(heap);
+		}
 		void* chunk = heap.try_alloc(size, is_gc_object);
 		if (chunk) {
+			heap.allocated_since_gc = true;
 			last_alloc_heap = aheap;
 			return chunk;
 		}
@@ -75,122 +119,572 @@ void* gc_context::try_alloc(size_t size, bool is_gc_object) {
 	return nullptr;
 }
 
-void* gc_context::alloc(size_t size, bool is_gc_object) {
+void* gc_context::try_alloc_or_refill(size_t size, bool is_gc_object) {
+	if (size <= MAX_BUFFERED_ALLOC_SIZE) {
+		alloc_buffer& buffer = current_thread()->buffer;
+		if (refill_alloc_buffer(buffer, size)) {
+			bytes_since_gc += (buffer.limit - buffer.cursor) * HEAP_UNIT_SIZE;
+			return bump_alloc(buffer, size, is_gc_object);
+		}
+		return nullptr;
+	}
+
+	void* chunk = try_alloc_in_heaps(size, is_gc_object);
+	if (chunk) {
+		bytes_since_gc += size;
+	}
+	return chunk;
+}
+
+void* gc_context::alloc_slow(size_t size, bool is_gc_object) {
 	//cout << "alloc(" << size << ")" << endl;
 
-	void* chunk = try_alloc(size, is_gc_object);
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	if (concurrent_marking) {
+		//Remark as soon as the marker is done, or when it can't keep up
+		if (marker_idle.load() || bytes_since_gc >= gc_budget) {
+			finish_concurrent_mark();
+		}
+	}
+	else if (bytes_since_gc >= gc_budget) {
+		collect_for_alloc();
+	}
+
+	if (size > LARGE_OBJECT_SIZE) {
+		return alloc_large(size, is_gc_object);
+	}
+
+	void* chunk = try_alloc_or_refill(size, is_gc_object);
 	if (chunk) {
 		return chunk;
 	}
 
 	//cout << "Not enough space." << endl;
 
-	if (heaps.size() > 0) { //GC would be worthless otherwise
-		perform_gc();
+	if (!grow_heap(size)) {
+		//At the limit, so whatever died has to go first
+		collect(true);
 
-		chunk = try_alloc(size, is_gc_object);
+		chunk = try_alloc_or_refill(size, is_gc_object);
 		if (chunk) {
 			return chunk;
 		}
+		if (!grow_heap(size)) {
+			cerr << "gc_context::alloc(" << size << ") failed: heap limit reached." << endl;
+			abort();
+		}
 	}
 
-	//cout << "Allocate new chunk" << endl;
+	chunk = try_alloc_or_refill(size, is_gc_object);
+	//cout << "allocated " << chunk << endl;
+	return chunk;
+}
+
+void* gc_context::alloc_large(size_t size, bool is_gc_object) {
+	large_object object;
+	object.size = align(size, HEAP_PAGE_SIZE);
+
+	if (!within_heap_limit(object.size)) {
+		collect(true);
+		if (!within_heap_limit(object.size)) {
+			cerr << "gc_context::alloc_large(" << size << ") failed: heap limit reached." << endl;
+			abort();
+		}
+	}
+
+	object.start = (char*) alloc_pages(object.size, true);
+	object.is_gc_object = is_gc_object;
+	object.marked = false;
+	object.remembered = false;
+
+	if (!object.start) {
+		cerr << "gc_context::alloc_large(" << size << ") failed." << endl;
+		abort();
+	}
+
+	large_objects.push_back(object);
+	large_object_map.set_range(object.start, object.size, &large_objects.back());
+	large_object_size += object.size;
+	bytes_since_gc += object.size;
+
+	return object.start;
+}
 
-	size_t new_heap_size = PREFERRED_HEAP_SIZE;
-	if (new_heap_size < size) {
-		new_heap_size = size;
+void gc_context::collect_for_alloc() {
+	if (config.generational) {
+		collect(false);
+
+		//Old objects only die in full collections, but most objects die young,
+		//so the old generation may grow by a budget before paying for one.
+		if (live_size < full_gc_live_size + gc_budget) {
+			return;
+		}
+	}
+
+	if (config.concurrent_mark) {
+		start_concurrent_mark();
 	}
-	heaps.push_back(gc_heap(new_heap_size));
+	else {
+		collect(true);
+	}
+}
+
+bool gc_context::within_heap_limit(size_t size) const {
+	return config.max_heap_size == 0 || total_heap_size() + size <= config.max_heap_size;
+}
+
+bool gc_context::grow_heap(size_t size) {
+	size_t small_heap_size = total_heap_size() - large_object_size;
+	size_t new_heap_size = size_t(double(small_heap_size) * (config.heap_growth_factor - 1));
+	if (new_heap_size < PREFERRED_HEAP_SIZE) {
+		new_heap_size = PREFERRED_HEAP_SIZE;
+	}
+	if (!within_heap_limit(new_heap_size)) {
+		//Whatever is left below the limit, as long as it fits the allocation
+		new_heap_size = config.max_heap_size - total_heap_size();
+	}
+	if (new_heap_size < size || !within_heap_limit(align(new_heap_size, HEAP_PAGE_SIZE))) {
+		return false;
+	}
+
+	//cout << "Allocate new chunk" << endl;
+
+	add_heap(new_heap_size);
+	return true;
+}
+
+gc_heap& gc_context::add_heap(size_t size) {
+	return add_heap(gc_heap(size));
+}
+
+gc_heap& gc_context::add_heap(gc_heap&& new_heap) {
+	heaps.push_back(std::move(new_heap));
 	gc_heap& heap = heaps.back();
-	if (heap.heap_aligned < first_heap) {
-		first_heap = heap.heap_aligned;
+	heap_map.set_range(heap.heap_aligned, heap.heap_size, &heap);
+	last_alloc_heap = heaps.size() - 1;
+
+	return heap;
+}
+
+bool gc_context::refill_alloc_buffer(alloc_buffer& buffer, size_t size) {
+	retire_alloc_buffer(buffer);
+
+	size_t block_count = div_round_up(size, HEAP_UNIT_SIZE);
+	if (block_count == 0) {
+		block_count = 1;
 	}
-	if (heap.heap + heap.heap_size > last_heap) {
-		last_heap = heap.heap + heap.heap_size;
+
+	if (last_alloc_heap >= heaps.size()) {
+		last_alloc_heap = 0;
+	}
+	for (size_t i = 0; i < heaps.size(); ++i) {
+		size_t aheap = (last_alloc_heap + i) % heaps.size();
+		gc_heap& heap = heaps[aheap];
+		if (heap.needs_sweep) {
+			sweep_heap(heap);
+		}
+		free_run run;
+		if (heap.try_reserve_run(block_count, ALLOC_BUFFER_SIZE / HEAP_UNIT_SIZE, run)) {
+			buffer.heap = &heap;
+			buffer.cursor = run.start;
+			buffer.limit = run.start + run.length;
+			heap.allocated_since_gc = true;
+			last_alloc_heap = aheap;
+			return true;
+		}
 	}
 
-	chunk = heap.try_alloc(size, is_gc_object);
-	//cout << "allocated " << chunk << endl;
-	return chunk;
+	return false;
+}
+
+void gc_context::retire_alloc_buffer(alloc_buffer& buffer) {
+	if (buffer.cursor < buffer.limit) {
+		buffer.heap->release_run(buffer.cursor, buffer.limit - buffer.cursor);
+	}
+	buffer.cursor = 0;
+	buffer.limit = 0;
+}
+
+void gc_context::retire_alloc_buffers() {
+	for (gc_thread& thread : threads) {
+		retire_alloc_buffer(thread.buffer);
+	}
+}
+
+void gc_context::reserve_heap(size_t size) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	add_heap(size);
+
+	//Filling it must not trigger a collection either
+	if (gc_budget < bytes_since_gc + size) {
+		gc_budget = bytes_since_gc + size;
+	}
+}
+
+void gc_context::set_generational(bool enabled) {
+	if (config.generational && !enabled) {
+		forget_remembered_set();
+	}
+	config.generational = enabled;
 }
 
 void gc_context::perform_gc() {
-	mark();
-	sweep();
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	collect(true);
 }
 
-gc_heap* gc_context::find_owner_heap(void* obj, bool is_gc_object) {
-	if (obj < first_heap || obj >= last_heap) {
-		return nullptr;
+void gc_context::perform_minor_gc() {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	collect(!config.generational);
+}
+
+//Called with the heap lock held, like everything that follows
+void gc_context::collect(bool full) {
+	if (concurrent_marking) {
+		//Whatever was asked for, completing the current cycle is the quickest way to free memory
+		finish_concurrent_mark();
+		return;
+	}
+
+	stop_the_world();
+	prepare_collection(full);
+
+	pin_roots = full && config.compaction;
+	mark(full);
+
+	finish_collection(full);
+	resume_the_world();
+}
+
+void gc_context::prepare_collection(bool full) {
+	//The unused part of the buffers would otherwise stay reserved through the sweep
+	retire_alloc_buffers();
+
+	//Dead objects must be gone before marking, or a stale value on the stack could revive
+	//them after their children were already freed
+	finish_sweep();
+
+	//That was the end of the last collection
+	stats.total_phases += stats.last_phases;
+	stats.last_phases = gc_phase_times();
+
+	used_before_gc = large_object_size;
+	for (gc_heap& heap : heaps) {
+		used_before_gc += heap.heap_bitset.count() * HEAP_UNIT_SIZE;
+	}
+	//From here on, bytes_since_gc is what gets allocated while marking concurrently.
+	//It gets a whole budget before it forces the remark.
+	stats.bytes_allocated += bytes_since_gc;
+	bytes_since_gc = 0;
+
+	if (pre_gc_callback) {
+		pre_gc_callback(current_stats(), full);
 	}
+}
 
+void gc_context::finish_collection(bool full) {
+	//Every young survivor is old now, so there are no old to young references left
+	forget_remembered_set();
+
+	if (pin_roots) {
+		std::chrono::steady_clock::time_point compact_start = std::chrono::steady_clock::now();
+		compact();
+		stats.last_phases.compact += seconds_since(compact_start);
+	}
+	sweep(full);
+
+	//Only marked large objects are left after the sweep. After a minor collection,
+	//this includes old objects that may have died since the last full one.
+	live_size = large_object_size;
 	for (gc_heap& heap : heaps) {
-		if (heap.contains(obj, is_gc_object)) {
-			return &heap;
+		live_size += heap.mark_bits.count() * HEAP_UNIT_SIZE;
+	}
+
+	size_t used = used_before_gc + bytes_since_gc;
+	if (used > live_size) {
+		stats.bytes_reclaimed += used - live_size;
+	}
+	stats.bytes_allocated += bytes_since_gc;
+	bytes_since_gc = 0;
+	stats.live_bytes = live_size;
+
+	if (full) {
+		++stats.full_collections;
+		full_gc_live_size = live_size;
+
+		//Live data over the heap size it can fill up to is target_live_ratio
+		double budget = double(live_size) * (1 - config.target_live_ratio) / config.target_live_ratio;
+		gc_budget = size_t(budget);
+		if (gc_budget < config.min_gc_budget) {
+			gc_budget = config.min_gc_budget;
 		}
+		if (live_size + gc_budget < config.min_heap_size) {
+			gc_budget = config.min_heap_size - live_size;
+		}
+	}
+	else {
+		++stats.minor_collections;
+	}
+
+	if (post_gc_callback) {
+		post_gc_callback(current_stats(), full);
+	}
+}
+
+gc_heap* gc_context::find_owner_heap(void* obj, bool is_gc_object) {
+	gc_heap* heap = heap_map.get(obj);
+	if (heap && heap->contains(obj, is_gc_object)) {
+		return heap;
 	}
 
 	return nullptr;
 }
 
 const gc_heap* gc_context::find_owner_heap(void* obj, bool is_gc_object) const {
-	if (obj < first_heap || obj >= last_heap) {
-		return nullptr;
+	const gc_heap* heap = heap_map.get(obj);
+	if (heap && heap->contains(obj, is_gc_object)) {
+		return heap;
 	}
 
-	for (const gc_heap& heap : heaps) {
-		if (heap.contains(obj, is_gc_object)) {
-			return &heap;
-		}
+	return nullptr;
+}
+
+large_object* gc_context::find_large_object(void* obj, bool is_gc_object) {
+	large_object* object = large_object_map.get(obj);
+	if (object && (is_gc_object ? object->is_gc_object && obj == object->start : true)) {
+		return object;
+	}
+
+	return nullptr;
+}
+
+const large_object* gc_context::find_large_object(void* obj, bool is_gc_object) const {
+	const large_object* object = large_object_map.get(obj);
+	if (object && (is_gc_object ? object->is_gc_object && obj == object->start : true)) {
+		return object;
 	}
 
 	return nullptr;
 }
 
 bool gc_context::is_heap_object(void* obj) const {
-	return find_owner_heap(obj, true) != nullptr;
+	return find_owner_heap(obj, true) != nullptr || find_large_object(obj, true) != nullptr;
 }
 
-void gc_context::mark() {
-	uintptr_t stack_pos = uintptr_t(get_stack_pointer());
-	++last_mark_id;
+size_t gc_context::total_heap_size() const {
+	size_t total = large_object_size;
+	for (const gc_heap& heap : heaps) {
+		total += heap.heap_size;
+	}
+	return total;
+}
+
+gc_stats gc_context::current_stats() const {
+	gc_stats current = stats;
+	current.total_phases += stats.last_phases;
+	current.bytes_allocated += bytes_since_gc;
+	current.heap_size = total_heap_size();
+	return current;
+}
+
+gc_stats gc_context::get_stats() {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	return current_stats();
+}
 
-	queue<core_representation*> objects_to_mark;
+std::vector<gc_heap_stats> gc_context::get_heap_stats() {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	std::vector<gc_heap_stats> heap_stats;
+	for (const gc_heap& heap : heaps) {
+		heap_stats.push_back(heap.get_stats());
+	}
+	return heap_stats;
+}
+
+void gc_context::set_pre_gc_callback(const gc_callback& callback) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	pre_gc_callback = callback;
+}
 
-	//Mark stack
+void gc_context::set_post_gc_callback(const gc_callback& callback) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	post_gc_callback = callback;
+}
+
+void gc_context::mark(bool full) {
+	//Spills the callee-saved registers into this frame, so that references only held
+	//in registers by our callers are seen by the stack scan
+	__builtin_unwind_init();
+	collect_stack_roots(uintptr_t(get_stack_pointer()));
+
+	reset_marks(full);
+
+	size_t thread_count = workers ? workers->size() : 1;
+	idle_markers.store(0);
+	auto mark_part = [&](size_t index) {
+		mark_roots(index, thread_count, full);
+
+		std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+		drain_mark_stack(index, thread_count);
+		if (index == 0) {
+			stats.last_phases.mark += seconds_since(trace_start);
+		}
+	};
+	if (workers) {
+		workers->run(mark_part);
+	}
+	else {
+		mark_part(0);
+	}
+}
+
+void gc_context::reset_marks(bool full) {
+	//In minor collections, old objects keep their mark_bits, so they are neither
+	//traced nor freed.
+	if (full) {
+		for (gc_heap& heap : heaps) {
+			heap.mark_bits.clear();
+			if (pin_roots) {
+				heap.pinned_bits.clear();
+			}
+		}
+		for (large_object& object : large_objects) {
+			object.marked = false;
+		}
+	}
+}
+
+void gc_context::collect_stack_roots(uintptr_t stack_pos) {
 	//Note that stack_pos is the start because the stack grows downwards.
-	mark_conservative_region(stack_pos, uintptr_t(stack_start), objects_to_mark);
+	root_stacks.clear();
+	gc_thread* self = current_thread();
+	root_stacks.push_back(std::make_pair(stack_pos, uintptr_t(self->stack_start)));
+	for (const gc_thread& thread : threads) {
+		if (&thread != self) {
+			root_stacks.push_back(std::make_pair(thread.stack_pos, uintptr_t(thread.stack_start)));
+		}
+	}
+}
 
-	//Mark static fields
-	for (class_type* cls : type_store->class_types) {
+void gc_context::mark_roots(size_t index, size_t thread_count, bool full) {
+	mark_stack& objects_to_mark = mark_stacks[index];
+	//Only the collecting thread records the phase times
+	bool timed = index == 0;
+	std::chrono::steady_clock::time_point phase_start = std::chrono::steady_clock::now();
+
+	//Mark stacks, one slice of each per marking thread
+	for (const std::pair<uintptr_t, uintptr_t>& stack : root_stacks) {
+		size_t slice_size = div_round_up((stack.second - stack.first) / sizeof(void*), thread_count) *
+				sizeof(void*);
+		uintptr_t slice_start = stack.first + index * slice_size;
+		uintptr_t slice_end = std::min(slice_start + slice_size, stack.second);
+		if (slice_start < slice_end) {
+			mark_conservative_region(slice_start, slice_end, objects_to_mark);
+		}
+	}
+	if (timed) {
+		stats.last_phases.root_scan += seconds_since(phase_start);
+		phase_start = std::chrono::steady_clock::now();
+	}
+
+	//Mark static fields, every thread_count-th class
+	for (size_t i = index; i < type_store->class_types.size(); i += thread_count) {
+		class_type* cls = type_store->class_types[i];
 		if (cls->static_size == 0) {
 			continue;
 		}
 
-		for (field& field : cls->fields) {
-			if (!field.flags.is_static) {
-				continue;
+		mark_extent(cls->static_field_data, cls->static_size);
+
+		for (size_t offset : cls->static_reference_offsets) {
+			core_representation* repr =
+					decode_reference(*((reference_t*) ((char*) cls->static_field_data + offset)));
+			if (repr) {
+				mark(repr, objects_to_mark);
 			}
-			if (field.type->type_category == TYPE_ARRAY ||
-					field.type->type_category == TYPE_CLASS_OBJECT) {
+		}
+	}
+	if (timed) {
+		stats.last_phases.static_scan += seconds_since(phase_start);
+	}
+
+	if (!full) {
+		phase_start = std::chrono::steady_clock::now();
+		//Old objects holding young references are roots
+		for (size_t i = index; i < remembered_set.size(); i += thread_count) {
+			mark_children(remembered_set[i], objects_to_mark);
+		}
+		if (timed) {
+			stats.last_phases.root_scan += seconds_since(phase_start);
+		}
+	}
+}
 
-				char* ptr = (char*) cls->static_field_data + field.field_offset;
+void gc_context::drain_mark_stack(size_t index, size_t thread_count) {
+	mark_stack& objects_to_mark = mark_stacks[index];
 
-				core_representation** reprptr = (core_representation**) ptr;
-				core_representation* repr = *reprptr;
-				repr->last_mark = last_mark_id;
-			}
+	for (;;) {
+		core_representation* object;
+		while (objects_to_mark.pop(object)) {
+			mark_children(object, objects_to_mark);
+		}
+
+		if (!steal_mark_work(index, thread_count)) {
+			return;
 		}
 	}
+}
 
-	while (!objects_to_mark.empty()) {
-		mark(objects_to_mark.front(), objects_to_mark);
-		objects_to_mark.pop();
+bool gc_context::steal_mark_work(size_t index, size_t thread_count) {
+	mark_stack& objects_to_mark = mark_stacks[index];
+
+	for (;;) {
+		//Our own published work first
+		for (size_t i = 0; i < thread_count; ++i) {
+			if (objects_to_mark.steal_from(mark_stacks[(index + i) % thread_count])) {
+				return true;
+			}
+		}
+
+		//Only busy threads publish work, and they look at their own before going idle,
+		//so once every thread is idle, there is nothing left anywhere
+		idle_markers.fetch_add(1);
+		for (;;) {
+			if (idle_markers.load() == thread_count) {
+				return false;
+			}
+
+			bool found_work = false;
+			for (size_t i = 0; i < thread_count; ++i) {
+				found_work |= mark_stacks[i].has_shared();
+			}
+			if (found_work) {
+				idle_markers.fetch_sub(1);
+				break;
+			}
+			std::this_thread::yield();
+		}
 	}
 }
 
-void gc_context::mark_conservative_region(uint32_t start, uint32_t end,
-		std::queue<core_representation*>& pending_list) {
+void gc_context::mark_conservative_region(uintptr_t start, uintptr_t end,
+		mark_stack& pending_list) {
 
 	for (uintptr_t pos = start; pos < end; pos += sizeof(void*)) {
 		void* value_at = *((void**) pos);
@@ -199,71 +693,111 @@ void gc_context::mark_conservative_region(uint32_t start, uint32_t end,
 
 		if (is_heap_object(value_at)) {
 			//cout << "Heap object" << endl;
-			pending_list.push((core_representation*) value_at);
+			mark((core_representation*) value_at, pending_list);
+
+			//Large objects never move anyway
+			gc_heap* heap = heap_map.get(value_at);
+			if (pin_roots && heap) {
+				//We can't tell whether it really is a reference, so it can't be updated
+				heap->pinned_bits.atomic_set(((char*) value_at - heap->heap_aligned) / HEAP_UNIT_SIZE);
+			}
 		}
 	}
 
 }
 
-void gc_context::mark(core_representation* object, queue<core_representation*>& pending_list) {
-	if (object->last_mark == last_mark_id) {
-		return;
+void gc_context::mark(core_representation* object, mark_stack& pending_list) {
+	//Only the first block is marked here, the rest once the object is traced
+	gc_heap* heap = heap_map.get(object);
+	if (heap) {
+		size_t block = ((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE;
+		//Cheap check first, other threads may get there between it and the update
+		if (heap->mark_bits.atomic_get(block) || heap->mark_bits.atomic_test_and_set(block)) {
+			return;
+		}
+	}
+	else {
+		large_object* large = large_object_map.get(object);
+		if (!large) {
+			return;
+		}
+		bool* marked = &large->marked;
+		if (__atomic_load_n(marked, __ATOMIC_RELAXED) || __atomic_exchange_n(marked, true, __ATOMIC_RELAXED)) {
+			return;
+		}
 	}
 
-	object->last_mark = last_mark_id;
+	//Only pushed once, by the thread that marked it
+	pending_list.push(object);
+}
 
-	if (object->type->type_category == TYPE_CLASS_OBJECT) {
-		const class_type* cls = ((class_type_info*) object->type)->cls;
+void gc_context::mark_children(core_representation* object, mark_stack& pending_list) {
+	type_info* type = object_type(object);
+	if (type->type_category == TYPE_CLASS_OBJECT) {
+		const class_type* cls = ((class_type_info*) type)->cls;
 
+		mark_extent(object, cls->computed_size);
 		mark_fields(cls, object, pending_list);
 	}
-	else if (object->type->type_category == TYPE_ARRAY) {
-		type_info* content_type = ((array_type_info*) object->type)->content_type;
+	else if (type->type_category == TYPE_ARRAY) {
+		const array_representation* array = (array_representation*) object;
+		type_info* content_type = ((array_type_info*) type)->content_type;
 
+		mark_extent(object, type_store->measure_array_size(content_type, array->array_length));
 		mark_array(content_type, object, pending_list);
 	}
 }
 
-void gc_context::mark_fields(const class_type* cls, core_representation* object,
-		queue<core_representation*>& pending_list) {
-	for (; cls; cls = cls->base_type) {
-		for (const field& field : cls->fields) {
-			if (!field.flags.is_static) { //We'll handle statics elsewhere
-				mark_field(field, object, pending_list);
-			}
+void gc_context::mark_extent(void* start, size_t size) {
+	gc_heap* heap = heap_map.get(start);
+	if (!heap) {
+		large_object* large = large_object_map.get(start);
+		if (large) {
+			__atomic_store_n(&large->marked, true, __ATOMIC_RELAXED);
 		}
+		return;
 	}
-}
 
-void gc_context::mark_field(const field& field, core_representation* object,
-		queue<core_representation*>& pending_list) {
-	if (field.type->type_category == TYPE_ARRAY || field.type->type_category == TYPE_CLASS_OBJECT) {
-		core_representation* location =
-				*((core_representation**) ((char*) object + field.field_offset));
+	size_t block_count = div_round_up(size, HEAP_UNIT_SIZE);
+	if (block_count == 0) {
+		block_count = 1;
+	}
 
-		if (location) {
-			//Not null
+	heap->mark_bits.atomic_set_range(((char*) start - heap->heap_aligned) / HEAP_UNIT_SIZE, block_count);
+}
 
-			pending_list.push(location);
+void gc_context::mark_fields(const class_type* cls, core_representation* object,
+		mark_stack& pending_list) {
+	//Statics are marked with the roots
+	for (const reference_range& range : cls->reference_ranges) {
+		reference_t* slots = (reference_t*) ((char*) object + range.offset);
+		for (size_t i = 0; i < range.count; ++i) {
+			//Written by the mutator while marking concurrently
+			core_representation* location = load_reference(&slots[i]);
+
+			if (location) {
+				//Not null
+
+				mark(location, pending_list);
+			}
 		}
 	}
 }
 
 void gc_context::mark_array(const type_info* content_type, core_representation* object,
-		queue<core_representation*>& pending_list) {
+		mark_stack& pending_list) {
 
 	array_representation* array = (array_representation*) object;
-	void* content = array->content;
+	void* content = array->content();
 
 	switch (content_type->type_category) {
 	case TYPE_CLASS_OBJECT:
-		for (size_t i = 0; i < array->array_length; ++i) {
-			pending_list.push(((core_representation**) content)[i]);
-		}
-		break;
 	case TYPE_ARRAY:
 		for (size_t i = 0; i < array->array_length; ++i) {
-			pending_list.push((core_representation*) ((array_representation**) content)[i]);
+			core_representation* element = load_reference(&((reference_t*) content)[i]);
+			if (element) {
+				mark(element, pending_list);
+			}
 		}
 		break;
 	default:
@@ -272,52 +806,92 @@ void gc_context::mark_array(const type_info* content_type, core_representation*
 	}
 }
 
-void gc_context::sweep() {
-	//cout << "sweep " << (int) last_mark_id << endl;
+void gc_context::sweep(bool full) {
+	for (gc_heap& heap : heaps) {
+		//Without new objects, a minor collection cannot free anything in a heap
+		if (full || heap.allocated_since_gc) {
+			heap.needs_sweep = true;
+		}
+		heap.allocated_since_gc = false;
+	}
+
+	//Unmapping them is cheap, and their pages are better off with the OS right away
+	std::chrono::steady_clock::time_point sweep_start = std::chrono::steady_clock::now();
+	sweep_large_objects();
+	stats.last_phases.sweep += seconds_since(sweep_start);
 
+	if (!config.lazy_sweep) {
+		finish_sweep();
+	}
+}
+
+void gc_context::finish_sweep() {
 	for (gc_heap& heap : heaps) {
-		for (size_t i = heap.heap_starts.find_next_unset(0, heap.heap_starts.size());
-				i < heap.heap_starts.size(); ++i) {
-			if (!heap.heap_starts.get(i)) {
-				continue;
-			}
+		if (heap.needs_sweep) {
+			sweep_heap(heap);
+		}
+	}
+}
 
-			core_representation* repr = (core_representation*) (heap.heap_aligned + i * HEAP_UNIT_SIZE);
+void gc_context::sweep_heap(gc_heap& heap) {
+	std::chrono::steady_clock::time_point sweep_start = std::chrono::steady_clock::now();
 
-			//cout << "Free " << repr << endl;
+	//Everything still in use was marked block by block, so no object needs to be looked at:
+	//dead starts are dropped and the allocation bitmap becomes the mark bitmap, a word at a time.
+	heap.heap_starts.and_with(heap.mark_bits);
+	heap.heap_bitset = heap.mark_bits;
+	heap.live_blocks = heap.mark_bits.count();
 
-			if (repr->last_mark != last_mark_id) {
-				//Free this object
-				heap.heap_starts.unset(i);
+	heap.rebuild_free_runs();
+	heap.needs_sweep = false;
 
-				size_t object_size;
+	stats.last_phases.sweep += seconds_since(sweep_start);
+}
 
-				if (repr->type->type_category == TYPE_ARRAY) {
-					object_size = sizeof(array_representation);
-					array_representation* arepr = (array_representation*) repr;
-					array_type_info* type_as_array = (array_type_info*) repr->type;
-					size_t content_size = type_store->measure_array_content_size(
-							type_as_array->content_type, arepr->array_length);
+void gc_context::sweep_large_objects() {
+	for (auto it = large_objects.begin(); it != large_objects.end();) {
+		if (it->marked) {
+			++it;
+			continue;
+		}
 
-					gc_heap* owner_heap = find_owner_heap(arepr->content, false);
+		large_object_map.set_range(it->start, it->size, nullptr);
+		free_pages(it->start, it->size);
+		large_object_size -= it->size;
+		it = large_objects.erase(it);
+	}
+}
 
-					owner_heap->free_non_gc_object(arepr->content, content_size);
-				}
-				else if (repr->type->type_category == TYPE_CLASS_OBJECT) {
-					class_type* cls = ((class_type_info*) repr->type)->cls;
+void gc_context::remember(core_representation* object) {
+	lock_guard<mutex> guard(remember_lock);
 
-					object_size = cls->computed_size;
-				}
-				else {
-					cerr << "sweep Unrecognized type " << repr->type << endl;
-					abort();
-				}
+	gc_heap* heap = heap_map.get(object);
+	if (!heap) {
+		large_object* large = large_object_map.get(object);
+		if (large && !large->remembered) {
+			large->remembered = true;
+			remembered_set.push_back(object);
+		}
+		return;
+	}
 
-				size_t block_size = div_round_up(object_size, HEAP_UNIT_SIZE);
-				heap.heap_bitset.unset_range(i, block_size);
-			}
+	size_t block = ((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE;
+	if (!heap->remembered_bits.get(block)) {
+		heap->remembered_bits.set(block);
+		remembered_set.push_back(object);
+	}
+}
+
+void gc_context::forget_remembered_set() {
+	for (core_representation* object : remembered_set) {
+		gc_heap* heap = heap_map.get(object);
+		if (!heap) {
+			large_object_map.get(object)->remembered = false;
+			continue;
 		}
+		heap->remembered_bits.unset(((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE);
 	}
+	remembered_set.clear();
 }
 
 void gc_context::prepare_static_fields() {
@@ -0,0 +1,221 @@
+#include "core.h"
+#include "gc_dump.h"
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+using std::string;
+using std::vector;
+using std::ofstream;
+using std::mutex;
+using std::lock_guard;
+
+//Calls f(target) for every non null reference held by object
+template <typename F>
+static void for_each_reference(core_representation* object, F f) {
+	for_each_reference_slot(object, [&](reference_t* slot) {
+		if (*slot) {
+			f(decode_reference(*slot));
+		}
+	});
+}
+
+/**
+ * A heap, or a large object, in address order. Objects are numbered in that order, so the
+ * index of an object is first_index plus the number of objects before it in its region.
+ */
+struct dump_region {
+	char* start;
+	gc_heap* heap;
+	large_object* large;
+	uint32_t first_index;
+	//Objects in the words of heap_starts before each word
+	vector<uint32_t> starts_before;
+
+	dump_region(char* start, gc_heap* heap, large_object* large) :
+			start(start), heap(heap), large(large), first_index(0) {}
+};
+
+static void write_padding(ofstream& out) {
+	static const char zeros[8] = {};
+	std::streamoff position = out.tellp();
+	if (position % 8 != 0) {
+		out.write(zeros, 8 - position % 8);
+	}
+}
+
+bool gc_context::dump_heap(const string& path) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	__builtin_unwind_init();
+	stop_the_world();
+
+	//Only live objects are left once a full collection is swept
+	collect(true);
+	finish_sweep();
+	collect_stack_roots(uintptr_t(get_stack_pointer()));
+
+	bool written = write_heap_dump(path);
+
+	resume_the_world();
+	return written;
+}
+
+bool gc_context::write_heap_dump(const string& path) {
+	ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out) {
+		return false;
+	}
+
+	vector<dump_region> regions;
+	for (gc_heap& heap : heaps) {
+		regions.push_back(dump_region(heap.heap_aligned, &heap, nullptr));
+	}
+	for (large_object& object : large_objects) {
+		if (object.is_gc_object) {
+			regions.push_back(dump_region(object.start, nullptr, &object));
+		}
+	}
+	std::sort(regions.begin(), regions.end(), [](const dump_region& a, const dump_region& b) {
+		return a.start < b.start;
+	});
+
+	std::unordered_map<const void*, dump_region*> region_of;
+	uint32_t object_count = 0;
+	for (dump_region& region : regions) {
+		region.first_index = object_count;
+		if (region.large) {
+			++object_count;
+		}
+		else {
+			const fast_bitset& starts = region.heap->heap_starts;
+			uint32_t before = 0;
+			for (size_t w = 0; w < starts.word_count(); ++w) {
+				region.starts_before.push_back(before);
+				before += __builtin_popcountll(starts.word(w));
+			}
+			object_count += before;
+		}
+		region_of[region.heap ? (const void*) region.heap : (const void*) region.large] = &region;
+	}
+
+	auto index_of = [&](core_representation* object) -> uint32_t {
+		gc_heap* heap = heap_map.get(object);
+		if (!heap) {
+			return region_of[large_object_map.get(object)]->first_index;
+		}
+		const dump_region* region = region_of[heap];
+		size_t block = ((char*) object - heap->heap_aligned) / HEAP_UNIT_SIZE;
+		uint64_t earlier_bits = (uint64_t(1) << (block & 63)) - 1;
+		return region->first_index + region->starts_before[block >> 6] +
+				__builtin_popcountll(heap->heap_starts.word(block >> 6) & earlier_bits);
+	};
+	auto for_each_object = [&](const std::function<void(core_representation*)>& f) {
+		for (dump_region& region : regions) {
+			if (region.large) {
+				f((core_representation*) region.large->start);
+				continue;
+			}
+			const fast_bitset& starts = region.heap->heap_starts;
+			size_t bitcount = starts.size();
+			for (size_t i = starts.find_next_set(0, bitcount); i < bitcount;
+					i = starts.find_next_set(i + 1, bitcount)) {
+				f((core_representation*) (region.heap->heap_aligned + i * HEAP_UNIT_SIZE));
+			}
+		}
+	};
+
+	heap_dump_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, HEAP_DUMP_MAGIC, sizeof(HEAP_DUMP_MAGIC));
+	header.version = HEAP_DUMP_VERSION;
+	header.pointer_size = sizeof(void*);
+	//Written again with the counts and offsets at the end
+	out.write((const char*) &header, sizeof(header));
+
+	//Types are numbered as they are first seen
+	std::unordered_map<const type_info*, uint32_t> type_indices;
+	vector<const type_info*> types;
+
+	header.objects_offset = out.tellp();
+	header.object_count = object_count;
+	for_each_object([&](core_representation* object) {
+		auto type = type_indices.insert(std::make_pair(object_type(object), uint32_t(types.size())));
+		if (type.second) {
+			types.push_back(object_type(object));
+		}
+
+		heap_dump_object record;
+		record.address = uintptr_t(object);
+		record.size = type_store->measure_object_size(object);
+		record.first_reference = header.reference_count;
+		record.reference_count = 0;
+		for_each_reference(object, [&](core_representation*) { ++record.reference_count; });
+		record.type_index = type.first->second;
+		header.reference_count += record.reference_count;
+
+		out.write((const char*) &record, sizeof(record));
+	});
+
+	header.references_offset = out.tellp();
+	for_each_object([&](core_representation* object) {
+		for_each_reference(object, [&](core_representation* target) {
+			uint32_t target_index = index_of(target);
+			out.write((const char*) &target_index, sizeof(target_index));
+		});
+	});
+	write_padding(out);
+
+	header.roots_offset = out.tellp();
+	auto write_root = [&](core_representation* object, heap_dump_root_kind kind) {
+		heap_dump_root root;
+		root.object_index = index_of(object);
+		root.kind = kind;
+		out.write((const char*) &root, sizeof(root));
+		++header.root_count;
+	};
+	//Anything on a stack that looks like a reference, as the collector sees it
+	for (const std::pair<uintptr_t, uintptr_t>& stack : root_stacks) {
+		for (uintptr_t pos = stack.first; pos < stack.second; pos += sizeof(void*)) {
+			void* value = *((void**) pos);
+			if (is_heap_object(value)) {
+				write_root((core_representation*) value, HEAP_DUMP_ROOT_STACK);
+			}
+		}
+	}
+	for (class_type* cls : type_store->class_types) {
+		for (size_t offset : cls->static_reference_offsets) {
+			core_representation* object =
+					decode_reference(*((reference_t*) ((char*) cls->static_field_data + offset)));
+			if (object) {
+				write_root(object, HEAP_DUMP_ROOT_STATIC);
+			}
+		}
+	}
+
+	header.types_offset = out.tellp();
+	header.type_count = types.size();
+	string names;
+	for (const type_info* type : types) {
+		string name = type_store->type_name(type);
+
+		heap_dump_type record;
+		record.name_offset = names.size();
+		record.name_length = name.size();
+		record.category = type->type_category;
+		out.write((const char*) &record, sizeof(record));
+
+		names += name;
+	}
+
+	header.names_offset = out.tellp();
+	header.names_size = names.size();
+	out.write(names.data(), names.size());
+
+	out.seekp(0);
+	out.write((const char*) &header, sizeof(header));
+	out.close();
+	return !out.fail();
+}
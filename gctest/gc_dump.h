@@ -0,0 +1,66 @@
+#ifndef GC_DUMP_H_
+#define GC_DUMP_H_
+
+#include <cstdint>
+
+/**
+ * Heap dumps, written by gc_context::dump_heap. The file is a header followed by arrays of
+ * fixed size records, each starting at the offset given in the header and aligned to 8
+ * bytes, so that it can be mapped and used in place. Objects are sorted by address, and
+ * references and roots refer to them by index in the object array.
+ */
+#define HEAP_DUMP_MAGIC "GCHDUMP"
+#define HEAP_DUMP_VERSION 1
+
+struct heap_dump_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pointer_size;
+	uint64_t type_count;
+	uint64_t types_offset;
+	uint64_t object_count;
+	uint64_t objects_offset;
+	uint64_t reference_count;
+	uint64_t references_offset;
+	uint64_t root_count;
+	uint64_t roots_offset;
+	//Type names, not null terminated
+	uint64_t names_size;
+	uint64_t names_offset;
+};
+
+struct heap_dump_type {
+	uint64_t name_offset;
+	uint32_t name_length;
+	//A type_category_t
+	uint32_t category;
+};
+
+struct heap_dump_object {
+	uint64_t address;
+	uint64_t size;
+	//The outgoing references are references[first_reference, first_reference + reference_count)
+	uint64_t first_reference;
+	uint32_t reference_count;
+	uint32_t type_index;
+};
+
+typedef enum {
+	HEAP_DUMP_ROOT_STACK,
+	HEAP_DUMP_ROOT_STATIC
+} heap_dump_root_kind;
+
+struct heap_dump_root {
+	uint32_t object_index;
+	uint32_t kind;
+};
+
+/**
+ * Offline analysis of a heap dump, run with the --analyze command line argument.
+ * Prints the shallow and retained size of every type, and the largest subtrees of the
+ * dominator tree. The dump is mapped, not read, so only a few words per object are kept
+ * in memory. args are the dump file, optionally followed by --top N.
+ */
+int run_dump_analyzer(int argc, char** argv);
+
+#endif /* GC_DUMP_H_ */
@@ -0,0 +1,451 @@
+#include "gc_dump.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+#define NO_NODE UINT32_MAX
+
+//A read only mapping of a whole file
+class mapped_file {
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+public:
+	mapped_file() : data(nullptr), size(0) {}
+	mapped_file(const mapped_file& other) = delete;
+
+	bool open(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		size = size_t(file_size.QuadPart);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) {
+			CloseHandle(file);
+			return false;
+		}
+		data = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		return data != nullptr;
+#else
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		size = size_t(info.st_size);
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		//The mapping keeps the file open
+		close(fd);
+		if (mapped == MAP_FAILED) {
+			return false;
+		}
+		data = (const char*) mapped;
+		return true;
+#endif
+	}
+
+	~mapped_file() {
+		if (!data) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+		CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		munmap((void*) data, size);
+#endif
+	}
+
+	const char* get_data() const { return data; }
+	size_t get_size() const { return size; }
+};
+
+/**
+ * The object graph of a dump, with an extra node, root(), referencing every root.
+ * Everything is read from the mapping, nothing is copied.
+ */
+class dump_graph {
+	const char* data;
+	const heap_dump_header* header;
+	const heap_dump_object* objects;
+	const uint32_t* references;
+	const heap_dump_root* roots;
+	const heap_dump_type* types;
+	const char* names;
+
+	bool section_fits(uint64_t offset, uint64_t count, size_t record_size, size_t file_size) const {
+		return offset <= file_size && count <= (file_size - offset) / record_size;
+	}
+public:
+	//Objects not reachable from the roots in the dump, which were kept alive by stack slots
+	//gone by the time it was written. They are treated as roots.
+	vector<uint32_t> extra_roots;
+
+	//On failure, error says what is wrong with the file
+	bool load(const mapped_file& file, string& error) {
+		data = file.get_data();
+		error = "not a heap dump";
+		if (file.get_size() < sizeof(heap_dump_header)) {
+			return false;
+		}
+		header = (const heap_dump_header*) data;
+		if (std::memcmp(header->magic, HEAP_DUMP_MAGIC, sizeof(HEAP_DUMP_MAGIC)) != 0 ||
+				header->version != HEAP_DUMP_VERSION || header->object_count >= NO_NODE) {
+			return false;
+		}
+		if (!section_fits(header->objects_offset, header->object_count, sizeof(heap_dump_object), file.get_size()) ||
+				!section_fits(header->references_offset, header->reference_count, sizeof(uint32_t), file.get_size()) ||
+				!section_fits(header->roots_offset, header->root_count, sizeof(heap_dump_root), file.get_size()) ||
+				!section_fits(header->types_offset, header->type_count, sizeof(heap_dump_type), file.get_size()) ||
+				!section_fits(header->names_offset, header->names_size, 1, file.get_size())) {
+			error = "a section runs past the end of the file";
+			return false;
+		}
+
+		objects = (const heap_dump_object*) (data + header->objects_offset);
+		references = (const uint32_t*) (data + header->references_offset);
+		roots = (const heap_dump_root*) (data + header->roots_offset);
+		types = (const heap_dump_type*) (data + header->types_offset);
+		names = data + header->names_offset;
+
+		//Indices are used as they are from here on
+		for (uint64_t i = 0; i < header->type_count; ++i) {
+			if (types[i].name_offset > header->names_size ||
+					types[i].name_length > header->names_size - types[i].name_offset) {
+				error = "type " + std::to_string(i) + " has a name out of range";
+				return false;
+			}
+		}
+		for (uint64_t i = 0; i < header->object_count; ++i) {
+			if (objects[i].type_index >= header->type_count) {
+				error = "object " + std::to_string(i) + " has a type out of range";
+				return false;
+			}
+			if (objects[i].first_reference > header->reference_count ||
+					objects[i].reference_count > header->reference_count - objects[i].first_reference) {
+				error = "the references of object " + std::to_string(i) + " run past the reference table";
+				return false;
+			}
+		}
+		for (uint64_t i = 0; i < header->reference_count; ++i) {
+			if (references[i] >= header->object_count) {
+				error = "reference " + std::to_string(i) + " is to an object out of range";
+				return false;
+			}
+		}
+		for (uint64_t i = 0; i < header->root_count; ++i) {
+			if (roots[i].object_index >= header->object_count) {
+				error = "root " + std::to_string(i) + " is an object out of range";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint32_t root() const { return uint32_t(header->object_count); }
+	uint32_t node_count() const { return root() + 1; }
+	uint64_t root_count() const { return header->root_count; }
+	uint64_t type_count() const { return header->type_count; }
+
+	const heap_dump_object& object(uint32_t node) const { return objects[node]; }
+	uint64_t size(uint32_t node) const { return node == root() ? 0 : objects[node].size; }
+	uint32_t type_of(uint32_t node) const { return objects[node].type_index; }
+	string type_name(uint32_t type) const {
+		return string(names + types[type].name_offset, types[type].name_length);
+	}
+
+	uint64_t edge_count(uint32_t node) const {
+		if (node == root()) {
+			return header->root_count + extra_roots.size();
+		}
+		return objects[node].reference_count;
+	}
+	uint32_t edge(uint32_t node, uint64_t i) const {
+		if (node == root()) {
+			return i < header->root_count ? roots[i].object_index : extra_roots[i - header->root_count];
+		}
+		return references[objects[node].first_reference + i];
+	}
+};
+
+/**
+ * Dominators in the style of Cooper, Harvey and Kennedy, "A Simple, Fast Dominance
+ * Algorithm", but iterating over successors, so that no predecessor lists are needed.
+ * Nodes are numbered in reverse postorder from the root; whatever the roots don't reach
+ * becomes an extra root as it is found.
+ */
+class dominator_tree {
+	dump_graph& graph;
+	vector<uint32_t> rpo_number;
+	vector<uint32_t> rpo_nodes;
+
+	uint32_t intersect(uint32_t a, uint32_t b) const {
+		while (a != b) {
+			while (rpo_number[a] > rpo_number[b]) {
+				a = idom[a];
+			}
+			while (rpo_number[b] > rpo_number[a]) {
+				b = idom[b];
+			}
+		}
+		return a;
+	}
+
+	void number_nodes() {
+		uint32_t node_count = graph.node_count();
+		rpo_number.assign(node_count, NO_NODE);
+		vector<uint32_t> postorder;
+		postorder.reserve(node_count);
+
+		vector<std::pair<uint32_t, uint64_t>> stack;
+		stack.push_back(std::make_pair(graph.root(), uint64_t(0)));
+		//Set when seen, reset to the real number afterwards
+		rpo_number[graph.root()] = 0;
+		uint32_t next_unreached = 0;
+		while (!stack.empty()) {
+			uint32_t node = stack.back().first;
+			uint64_t& next_edge = stack.back().second;
+
+			if (next_edge == graph.edge_count(node) && node == graph.root()) {
+				while (next_unreached < graph.root() && rpo_number[next_unreached] != NO_NODE) {
+					++next_unreached;
+				}
+				if (next_unreached < graph.root()) {
+					graph.extra_roots.push_back(next_unreached);
+				}
+			}
+			if (next_edge == graph.edge_count(node)) {
+				postorder.push_back(node);
+				stack.pop_back();
+				continue;
+			}
+
+			uint32_t target = graph.edge(node, next_edge++);
+			if (rpo_number[target] == NO_NODE) {
+				rpo_number[target] = 0;
+				stack.push_back(std::make_pair(target, uint64_t(0)));
+			}
+		}
+
+		rpo_nodes.assign(postorder.rbegin(), postorder.rend());
+		for (uint32_t i = 0; i < rpo_nodes.size(); ++i) {
+			rpo_number[rpo_nodes[i]] = i;
+		}
+	}
+public:
+	vector<uint32_t> idom;
+	//Size of everything only reachable through each node, the node included
+	vector<uint64_t> retained;
+
+	//Adds the extra roots to graph
+	dominator_tree(dump_graph& graph) : graph(graph) {
+		number_nodes();
+
+		idom.assign(graph.node_count(), NO_NODE);
+		idom[graph.root()] = graph.root();
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (uint32_t node : rpo_nodes) {
+				for (uint64_t i = 0; i < graph.edge_count(node); ++i) {
+					uint32_t target = graph.edge(node, i);
+					if (target == graph.root()) {
+						continue;
+					}
+					uint32_t dominator = idom[target] == NO_NODE ? node : intersect(node, idom[target]);
+					if (dominator != idom[target]) {
+						idom[target] = dominator;
+						changed = true;
+					}
+				}
+			}
+		}
+
+		//Dominators come first in reverse postorder, so going backwards adds children first
+		retained.resize(graph.node_count());
+		for (uint32_t node = 0; node < graph.node_count(); ++node) {
+			retained[node] = graph.size(node);
+		}
+		for (size_t i = rpo_nodes.size() - 1; i > 0; --i) {
+			retained[idom[rpo_nodes[i]]] += retained[rpo_nodes[i]];
+		}
+	}
+
+	uint64_t total_size() const { return retained[graph.root()]; }
+};
+
+//The children of each node in a dominator tree
+struct dominated_lists {
+	vector<uint32_t> first;
+	vector<uint32_t> nodes;
+
+	dominated_lists(const dump_graph& graph, const dominator_tree& tree) :
+			first(graph.node_count() + 1, 0), nodes(graph.node_count() - 1) {
+		for (uint32_t node = 0; node < graph.root(); ++node) {
+			++first[tree.idom[node] + 1];
+		}
+		for (uint32_t node = 0; node < graph.node_count(); ++node) {
+			first[node + 1] += first[node];
+		}
+		vector<uint32_t> filled(first.begin(), first.end() - 1);
+		for (uint32_t node = 0; node < graph.root(); ++node) {
+			nodes[filled[tree.idom[node]]++] = node;
+		}
+	}
+
+	//Up to limit children of node, the ones retaining the most first
+	vector<uint32_t> largest(uint32_t node, size_t limit, const dominator_tree& tree) const {
+		vector<uint32_t> children(nodes.begin() + first[node], nodes.begin() + first[node + 1]);
+		limit = std::min(limit, children.size());
+		std::partial_sort(children.begin(), children.begin() + limit, children.end(),
+				[&](uint32_t a, uint32_t b) { return tree.retained[a] > tree.retained[b]; });
+		children.resize(limit);
+		return children;
+	}
+};
+
+struct type_summary {
+	uint32_t type;
+	uint64_t count;
+	uint64_t shallow;
+	//Of all the instances together: only those not dominated by another instance count
+	uint64_t retained;
+};
+
+static vector<type_summary> summarize_types(const dump_graph& graph, const dominator_tree& tree,
+		const dominated_lists& dominated) {
+	vector<type_summary> summaries(graph.type_count());
+	for (uint32_t type = 0; type < summaries.size(); ++type) {
+		summaries[type].type = type;
+		summaries[type].count = 0;
+		summaries[type].shallow = 0;
+		summaries[type].retained = 0;
+	}
+
+	//Instances of each type on the path from the root, while walking the dominator tree
+	vector<uint32_t> open_instances(graph.type_count(), 0);
+	vector<std::pair<uint32_t, uint32_t>> stack;
+	stack.push_back(std::make_pair(graph.root(), dominated.first[graph.root()]));
+	while (!stack.empty()) {
+		uint32_t node = stack.back().first;
+		uint32_t& next_child = stack.back().second;
+
+		if (next_child == dominated.first[node + 1]) {
+			if (node != graph.root()) {
+				--open_instances[graph.type_of(node)];
+			}
+			stack.pop_back();
+			continue;
+		}
+
+		uint32_t child = dominated.nodes[next_child++];
+		type_summary& summary = summaries[graph.type_of(child)];
+		++summary.count;
+		summary.shallow += graph.size(child);
+		if (open_instances[summary.type]++ == 0) {
+			summary.retained += tree.retained[child];
+		}
+		stack.push_back(std::make_pair(child, dominated.first[child]));
+	}
+
+	std::sort(summaries.begin(), summaries.end(), [](const type_summary& a, const type_summary& b) {
+		return a.retained > b.retained;
+	});
+	return summaries;
+}
+
+static void print_dominated(const dump_graph& graph, const dominator_tree& tree,
+		const dominated_lists& dominated, uint32_t node, size_t depth, size_t limit) {
+	for (uint32_t child : dominated.largest(node, limit, tree)) {
+		const heap_dump_object& object = graph.object(child);
+		cout << string(2 * depth + 2, ' ') << std::setw(12) << tree.retained[child] << "  "
+				<< graph.type_name(object.type_index) << " @0x" << std::hex << object.address
+				<< std::dec << endl;
+		//Everything below the first level, only the few largest
+		if (depth < 3) {
+			print_dominated(graph, tree, dominated, child, depth + 1, 3);
+		}
+	}
+}
+
+int run_dump_analyzer(int argc, char** argv) {
+	const char* path = nullptr;
+	size_t top = 20;
+	for (int i = 0; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+			top = size_t(std::atol(argv[++i]));
+		}
+		else {
+			path = argv[i];
+		}
+	}
+	if (!path) {
+		cerr << "Usage: --analyze <dump file> [--top N]" << endl;
+		return 1;
+	}
+
+	mapped_file file;
+	if (!file.open(path)) {
+		cerr << "Can't map " << path << endl;
+		return 1;
+	}
+	dump_graph graph;
+	string error;
+	if (!graph.load(file, error)) {
+		cerr << path << ": " << error << endl;
+		return 1;
+	}
+
+	dominator_tree tree(graph);
+	dominated_lists dominated(graph, tree);
+
+	cout << path << ": " << graph.root() << " objects, " << tree.total_size() << " bytes, "
+			<< graph.root_count() << " roots";
+	if (!graph.extra_roots.empty()) {
+		cout << ", " << graph.extra_roots.size() << " objects only reachable from stale stack slots";
+	}
+	cout << endl << endl;
+
+	cout << "    retained       shallow     count  type" << endl;
+	vector<type_summary> summaries = summarize_types(graph, tree, dominated);
+	for (size_t i = 0; i < summaries.size() && i < top; ++i) {
+		const type_summary& summary = summaries[i];
+		cout << std::setw(12) << summary.retained << "  " << std::setw(12) << summary.shallow << "  "
+				<< std::setw(8) << summary.count << "  " << graph.type_name(summary.type) << endl;
+	}
+
+	cout << endl << "Dominator tree, by retained size:" << endl;
+	print_dominated(graph, tree, dominated, graph.root(), 0, top);
+	return 0;
+}
@@ -6,32 +6,44 @@
 using std::cerr;
 using std::endl;
 using std::move;
-using std::malloc;
-using std::free;
 
-gc_heap::gc_heap(size_t heap_size) : heap_size(align(heap_size, HEAP_UNIT_SIZE)),
-		heap_bitset(div_round_up(heap_size, HEAP_UNIT_SIZE)), heap_starts(heap_bitset.size()) {
+gc_heap::gc_heap(size_t heap_size) :
+		gc_heap((char*) alloc_pages(align(heap_size, HEAP_PAGE_SIZE)), align(heap_size, HEAP_PAGE_SIZE)) {
+}
 
-	heap = (char*) malloc(this->heap_size);
-	heap_aligned = (char*) align((uintptr_t) heap, HEAP_UNIT_SIZE);
+gc_heap::gc_heap(char* pages, size_t heap_size) : heap_size(heap_size), heap(pages),
+		heap_aligned(pages), heap_bitset(heap_size / HEAP_UNIT_SIZE), heap_starts(heap_bitset.size()),
+		mark_bits(heap_bitset.size()), live_blocks(0), remembered_bits(heap_bitset.size()),
+		pinned_bits(heap_bitset.size()),
+		has_released_runs(false), needs_sweep(false), allocated_since_gc(false) {
 
 	//cout << "Create heap in " << (void*) heap << ", size " << this->heap_size << endl;
-	//cout << "aligned at " << (void*) heap_aligned << endl;
 
 	if (!heap) {
 		cerr << "gc_context::setup_heap(" << this->heap_size << ") failed." << endl;
 		abort();
 	}
+
+	push_free_run(0, heap_bitset.size());
 }
 
 gc_heap::gc_heap(gc_heap&& other) : heap_size(other.heap_size), heap(other.heap),
-		heap_aligned(other.heap_aligned) {
+		heap_aligned(other.heap_aligned), live_blocks(other.live_blocks),
+		has_released_runs(other.has_released_runs), needs_sweep(other.needs_sweep),
+		allocated_since_gc(other.allocated_since_gc) {
 	other.heap_size = 0;
 	other.heap = nullptr;
 	other.heap_aligned = nullptr;
 
 	heap_bitset = move(other.heap_bitset);
 	heap_starts = move(other.heap_starts);
+	mark_bits = move(other.mark_bits);
+	remembered_bits = move(other.remembered_bits);
+	pinned_bits = move(other.pinned_bits);
+	forwarding = move(other.forwarding);
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		free_runs[c] = move(other.free_runs[c]);
+	}
 }
 
 gc_heap& gc_heap::operator =(const gc_heap& other) {
@@ -40,13 +52,24 @@ gc_heap& gc_heap::operator =(const gc_heap& other) {
 	heap_aligned = other.heap_aligned;
 	heap_bitset = other.heap_bitset;
 	heap_starts = other.heap_starts;
+	mark_bits = other.mark_bits;
+	live_blocks = other.live_blocks;
+	remembered_bits = other.remembered_bits;
+	pinned_bits = other.pinned_bits;
+	forwarding = other.forwarding;
+	has_released_runs = other.has_released_runs;
+	needs_sweep = other.needs_sweep;
+	allocated_since_gc = other.allocated_since_gc;
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		free_runs[c] = other.free_runs[c];
+	}
 
 	return *this;
 }
 
 gc_heap::~gc_heap() {
 	if (heap) {
-		free(heap);
+		free_pages(heap, heap_size);
 	}
 }
 
@@ -56,48 +79,168 @@ void* gc_heap::try_alloc(size_t size, bool is_gc_object) {
 		return nullptr;
 	}
 
-	bool block_started = false;
-	size_t block_start = 0;
+	size_t block_count = div_round_up(size, HEAP_UNIT_SIZE);
+	if (block_count == 0) {
+		block_count = 1;
+	}
 
-	for (size_t i = heap_bitset.find_next_unset(0, heap_bitset.size()); i < heap_bitset.size();) {
-		if (heap_bitset.get(i)) {
-			block_started = false;
-			i = heap_bitset.find_next_unset(i + 1, heap_bitset.size());
-			continue;
+	//Exact size classes: any run in them is big enough, so the first non-empty one is the best fit
+	free_run run;
+	bool found = false;
+	for (size_t c = size_class(block_count); c < SIZE_CLASS_COUNT - 1; ++c) {
+		if (!free_runs[c].empty()) {
+			run = free_runs[c].back();
+			free_runs[c].pop_back();
+			found = true;
+			break;
 		}
+	}
 
-		if (block_started) {
-			size_t block_size = i - block_start + 1;
-			if (block_size * HEAP_UNIT_SIZE >= size) {
-				if (is_gc_object) {
-					heap_starts.set(block_start);
-				}
-				heap_bitset.set_range(block_start, block_size);
-				return heap_aligned + block_start * HEAP_UNIT_SIZE;
+	if (!found) {
+		//Last class holds runs of any (large) length, so we need a first fit search
+		std::vector<free_run>& large_runs = free_runs[SIZE_CLASS_COUNT - 1];
+		for (size_t i = 0; i < large_runs.size(); ++i) {
+			if (large_runs[i].length >= block_count) {
+				run = large_runs[i];
+				large_runs[i] = large_runs.back();
+				large_runs.pop_back();
+				found = true;
+				break;
 			}
 		}
-		else {
-			//cout << "Free block starting at " << i << endl;
-			block_start = i;
-			block_started = true;
-			if (HEAP_UNIT_SIZE >= size) {
-				heap_bitset.set(i);
-				if (is_gc_object) {
-					heap_starts.set(i);
-				}
-				return heap_aligned + block_start * HEAP_UNIT_SIZE;
-			}
+	}
+
+	if (!found) {
+		if (has_released_runs && heap_bitset.find_unset_run(0, block_count) < heap_bitset.size()) {
+			//Only fits once released runs are merged with their neighbours
+			rebuild_free_runs();
+			return try_alloc(size, is_gc_object);
 		}
 
-		++i;
+		//Not enough space
+		return nullptr;
+	}
+
+	heap_bitset.set_range(run.start, block_count);
+	if (is_gc_object) {
+		//Bump allocating threads may set bits in the same word
+		heap_starts.atomic_set(run.start);
+	}
+	if (run.length > block_count) {
+		push_free_run(run.start + block_count, run.length - block_count);
+	}
+
+	return heap_aligned + run.start * HEAP_UNIT_SIZE;
+}
+
+bool gc_heap::try_reserve_run(size_t min_blocks, size_t max_blocks, free_run& reserved) {
+	//Unlike try_alloc, prefer the largest runs so the reservation lasts longer
+	free_run run;
+	bool found = false;
+	std::vector<free_run>& large_runs = free_runs[SIZE_CLASS_COUNT - 1];
+	for (size_t i = 0; i < large_runs.size(); ++i) {
+		if (large_runs[i].length >= min_blocks) {
+			run = large_runs[i];
+			large_runs[i] = large_runs.back();
+			large_runs.pop_back();
+			found = true;
+			break;
+		}
+	}
+
+	for (size_t c = SIZE_CLASS_COUNT - 1; !found && c-- > size_class(min_blocks);) {
+		if (!free_runs[c].empty()) {
+			run = free_runs[c].back();
+			free_runs[c].pop_back();
+			found = true;
+		}
+	}
+
+	if (!found) {
+		return false;
 	}
 
-	//Not enough space
-	return nullptr;
+	reserved.start = run.start;
+	reserved.length = run.length < max_blocks ? run.length : max_blocks;
+	heap_bitset.set_range(reserved.start, reserved.length);
+	if (run.length > reserved.length) {
+		push_free_run(run.start + reserved.length, run.length - reserved.length);
+	}
+
+	return true;
 }
 
 void gc_heap::free_non_gc_object(void* obj, size_t size) {
 	size_t block_size = div_round_up(size, HEAP_UNIT_SIZE);
+	if (block_size == 0) {
+		block_size = 1;
+	}
 	size_t start_idx = ((char*) obj - heap_aligned) / HEAP_UNIT_SIZE;
-	heap_bitset.unset_range(start_idx, block_size);
+	release_run(start_idx, block_size);
+}
+
+void gc_heap::release_run(size_t start, size_t length) {
+	heap_bitset.unset_range(start, length);
+
+	//Not coalesced with its neighbours until the next rebuild_free_runs
+	push_free_run(start, length);
+	has_released_runs = true;
+}
+
+void gc_heap::push_free_run(size_t start, size_t length) {
+	free_run run;
+	run.start = start;
+	run.length = length;
+	free_runs[size_class(length)].push_back(run);
+}
+
+void gc_heap::rebuild_free_runs() {
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		free_runs[c].clear();
+	}
+	has_released_runs = false;
+
+	size_t bitcount = heap_bitset.size();
+
+	size_t start = heap_bitset.find_next_unset(0, bitcount);
+	while (start < bitcount) {
+		size_t end = heap_bitset.find_next_set(start, bitcount - start);
+		push_free_run(start, end - start);
+
+		if (end >= bitcount) {
+			break;
+		}
+		start = heap_bitset.find_next_unset(end, bitcount - end);
+	}
+}
+
+gc_heap_stats gc_heap::get_stats() const {
+	//Until the heap is swept, what the last collection marked is what is left of it
+	const fast_bitset& used = needs_sweep ? mark_bits : heap_bitset;
+	size_t bitcount = used.size();
+
+	gc_heap_stats stats;
+	stats.size = heap_size;
+	stats.used_bytes = used.count() * HEAP_UNIT_SIZE;
+	stats.free_bytes = heap_size - stats.used_bytes;
+	stats.free_runs = 0;
+	stats.largest_free_run = 0;
+
+	size_t start = used.find_next_unset(0, bitcount);
+	while (start < bitcount) {
+		size_t end = used.find_next_set(start, bitcount - start);
+		++stats.free_runs;
+		if ((end - start) * HEAP_UNIT_SIZE > stats.largest_free_run) {
+			stats.largest_free_run = (end - start) * HEAP_UNIT_SIZE;
+		}
+
+		if (end >= bitcount) {
+			break;
+		}
+		start = used.find_next_unset(end, bitcount - end);
+	}
+
+	stats.fragmentation = stats.free_bytes == 0 ? 0 :
+			1 - double(stats.largest_free_run) / double(stats.free_bytes);
+	return stats;
 }
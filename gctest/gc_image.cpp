@@ -0,0 +1,583 @@
+#include "core.h"
+#include "gc_image.h"
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::ofstream;
+using std::ifstream;
+using std::mutex;
+using std::lock_guard;
+using std::cerr;
+using std::endl;
+
+static void write_padding(ofstream& out, size_t alignment) {
+	static const char zeros[HEAP_PAGE_SIZE] = {};
+	std::streamoff position = out.tellp();
+	if (position % alignment != 0) {
+		out.write(zeros, alignment - position % alignment);
+	}
+}
+
+template <typename T>
+static void write_section(ofstream& out, const T* records, size_t count, uint64_t& section_count,
+		uint64_t& section_offset) {
+	write_padding(out, 8);
+	section_count = count;
+	section_offset = out.tellp();
+	out.write((const char*) records, count * sizeof(T));
+}
+
+template <typename T>
+static bool read_section(ifstream& in, uint64_t offset, uint64_t count, vector<T>& records) {
+	//Also keeps a broken count from allocating everything
+	in.seekg(0, std::ios::end);
+	uint64_t file_size = uint64_t(in.tellg());
+	if (offset > file_size || count > (file_size - offset) / sizeof(T)) {
+		return false;
+	}
+
+	records.resize(count);
+	in.seekg(std::streamoff(offset));
+	return bool(in.read((char*) records.data(), std::streamsize(count * sizeof(T))));
+}
+
+static inline void write_pointer(char* at, uintptr_t value) {
+	std::memcpy(at, &value, sizeof(value));
+}
+
+#ifdef GC_COMPRESSED_REFERENCES
+#define IMAGE_ADDRESS_BASE uintptr_t(reference_space_base)
+#else
+#define IMAGE_ADDRESS_BASE uintptr_t(0)
+#endif
+
+//A reference slot, to an image address. See GC_IMAGE_BASE.
+static inline void write_reference(char* at, uint64_t address) {
+	reference_t value = encode_reference((core_representation*) (IMAGE_ADDRESS_BASE + uintptr_t(address)));
+	std::memcpy(at, &value, sizeof(value));
+}
+
+static inline uint64_t read_reference(const char* at) {
+	reference_t value;
+	std::memcpy(&value, at, sizeof(value));
+	return uintptr_t(decode_reference(value)) - IMAGE_ADDRESS_BASE;
+}
+
+bool gc_context::save_image(const string& path) {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	stop_the_world();
+	bool written = write_image(path);
+	resume_the_world();
+	return written;
+}
+
+bool gc_context::write_image(const string& path) {
+	gc_image_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, GC_IMAGE_MAGIC, sizeof(GC_IMAGE_MAGIC));
+	header.version = GC_IMAGE_VERSION;
+	header.pointer_size = sizeof(void*);
+	header.heap_unit_size = HEAP_UNIT_SIZE;
+	header.reorder_fields = type_store->reorder_fields;
+#ifdef GC_COMPACT_HEADERS
+	header.compact_headers = 1;
+#endif
+#ifdef GC_COMPRESSED_REFERENCES
+	header.compressed_references = 1;
+#endif
+	header.image_base = GC_IMAGE_BASE;
+
+	//Classes are stored by class_id, those that aren't in the type store can't be
+	auto class_index = [&](const class_type* cls) -> uint32_t {
+		return type_store->class_by_id(cls->class_id) == cls ? cls->class_id : GC_IMAGE_NO_INDEX;
+	};
+
+	//Content types are numbered before their array types, so they can be rebuilt in order
+	std::unordered_map<const type_info*, uint32_t> type_indices;
+	vector<gc_image_type> types;
+	bool unknown_class = false;
+	std::function<uint32_t(const type_info*)> type_index = [&](const type_info* type) -> uint32_t {
+		auto found = type_indices.find(type);
+		if (found != type_indices.end()) {
+			return found->second;
+		}
+
+		gc_image_type record;
+		record.category = type->type_category;
+		record.index = GC_IMAGE_NO_INDEX;
+		if (type->type_category == TYPE_ARRAY) {
+			record.index = type_index(((const array_type_info*) type)->content_type);
+		}
+		else if (type->type_category == TYPE_CLASS_OBJECT) {
+			record.index = class_index(((const class_type_info*) type)->cls);
+			unknown_class |= record.index == GC_IMAGE_NO_INDEX;
+		}
+
+		uint32_t index = uint32_t(types.size());
+		types.push_back(record);
+		type_indices[type] = index;
+		return index;
+	};
+
+	//The heap section: static field data, then the objects reachable from it, breadth first
+	size_t heap_used = 0;
+	auto reserve_blocks = [&](size_t size) {
+		size_t offset = heap_used;
+		heap_used += std::max(div_round_up(size, HEAP_UNIT_SIZE), size_t(1)) * HEAP_UNIT_SIZE;
+		return offset;
+	};
+
+	vector<uint64_t> static_data_offsets(type_store->class_types.size(), 0);
+	std::unordered_map<core_representation*, uint64_t> object_offsets;
+	vector<core_representation*> objects;
+	auto visit = [&](reference_t* slot) {
+		core_representation* object = decode_reference(*slot);
+		if (object && object_offsets.insert(std::make_pair(object, uint64_t(0))).second) {
+			objects.push_back(object);
+		}
+	};
+	for (size_t i = 0; i < type_store->class_types.size(); ++i) {
+		class_type* cls = type_store->class_types[i];
+		if (cls->static_size == 0) {
+			continue;
+		}
+		static_data_offsets[i] = reserve_blocks(cls->static_size);
+		for (size_t offset : cls->static_reference_offsets) {
+			visit((reference_t*) ((char*) cls->static_field_data + offset));
+		}
+	}
+	for (size_t i = 0; i < objects.size(); ++i) {
+		object_offsets[objects[i]] = reserve_blocks(type_store->measure_object_size(objects[i]));
+		for_each_reference_slot(objects[i], visit);
+	}
+
+	vector<char> heap_image(align(heap_used, HEAP_PAGE_SIZE));
+	vector<uint64_t> relocations;
+	auto copy_reference = [&](uint64_t slot_offset, core_representation* target) {
+		if (target) {
+			write_reference(&heap_image[slot_offset], header.image_base + object_offsets[target]);
+			relocations.push_back(slot_offset);
+		}
+	};
+
+	vector<gc_image_object> object_records;
+	for (core_representation* object : objects) {
+		uint64_t offset = object_offsets[object];
+		std::memcpy(&heap_image[offset], object, type_store->measure_object_size(object));
+
+		gc_image_object record;
+		record.offset = offset;
+		record.type_index = type_index(object_type(object));
+		record.padding = 0;
+		object_records.push_back(record);
+#ifdef GC_COMPACT_HEADERS
+		//The rest of the word may hold a field
+		std::memcpy(&heap_image[offset], &record.type_index, sizeof(record.type_index));
+#else
+		write_pointer(&heap_image[offset], record.type_index);
+#endif
+
+		for_each_reference_slot(object, [&](reference_t* slot) {
+			copy_reference(offset + ((char*) slot - (char*) object), decode_reference(*slot));
+		});
+	}
+
+	vector<gc_image_class> classes;
+	vector<gc_image_field> fields;
+	vector<gc_image_method> methods;
+	vector<uint32_t> arguments;
+	vector<gc_image_range> ranges;
+	vector<uint64_t> static_references;
+	string names;
+	for (size_t i = 0; i < type_store->class_types.size(); ++i) {
+		const class_type* cls = type_store->class_types[i];
+
+		gc_image_class record;
+		record.name_offset = names.size();
+		record.name_length = uint32_t(cls->full_name.size());
+		names += cls->full_name;
+		record.base_index = GC_IMAGE_NO_INDEX;
+		if (cls->base_type) {
+			record.base_index = class_index(cls->base_type);
+			unknown_class |= record.base_index == GC_IMAGE_NO_INDEX;
+		}
+		record.computed_size = cls->computed_size;
+		record.static_size = cls->static_size;
+		record.static_data_offset = static_data_offsets[i];
+
+		record.first_field = uint32_t(fields.size());
+		record.field_count = uint32_t(cls->fields.size());
+		for (const field& f : cls->fields) {
+			gc_image_field field_record = gc_image_field();
+			field_record.field_offset = f.field_offset;
+			field_record.type_index = type_index(f.type);
+			field_record.is_public = f.flags.is_public;
+			field_record.is_static = f.flags.is_static;
+			fields.push_back(field_record);
+		}
+
+		record.first_method = uint32_t(methods.size());
+		record.method_count = uint32_t(cls->methods.size());
+		for (const method& m : cls->methods) {
+			gc_image_method method_record = gc_image_method();
+			method_record.virtual_offset = m.virtual_offset;
+			method_record.return_type_index = type_index(m.return_type);
+			method_record.is_public = m.flags.is_public;
+			method_record.is_static = m.flags.is_static;
+			method_record.is_virtual = m.flags.is_virtual;
+			method_record.first_argument = uint32_t(arguments.size());
+			method_record.argument_count = uint32_t(m.arguments.size());
+			for (const type_info* argument : m.arguments) {
+				arguments.push_back(type_index(argument));
+			}
+			methods.push_back(method_record);
+		}
+
+		record.first_range = uint32_t(ranges.size());
+		record.range_count = uint32_t(cls->reference_ranges.size());
+		for (const reference_range& range : cls->reference_ranges) {
+			gc_image_range range_record;
+			range_record.offset = range.offset;
+			range_record.count = range.count;
+			ranges.push_back(range_record);
+		}
+
+		record.first_static_reference = uint32_t(static_references.size());
+		record.static_reference_count = uint32_t(cls->static_reference_offsets.size());
+		static_references.insert(static_references.end(), cls->static_reference_offsets.begin(),
+				cls->static_reference_offsets.end());
+		classes.push_back(record);
+
+		if (cls->static_size > 0) {
+			std::memcpy(&heap_image[static_data_offsets[i]], cls->static_field_data, cls->static_size);
+			for (size_t offset : cls->static_reference_offsets) {
+				copy_reference(static_data_offsets[i] + offset,
+						decode_reference(*((reference_t*) ((char*) cls->static_field_data + offset))));
+			}
+		}
+	}
+
+	if (unknown_class) {
+		cerr << "gc_context::save_image: a type refers to a class missing from the type store" << endl;
+		return false;
+	}
+
+	ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out) {
+		return false;
+	}
+	//Written again with the counts and offsets at the end
+	out.write((const char*) &header, sizeof(header));
+	write_section(out, types.data(), types.size(), header.type_count, header.types_offset);
+	write_section(out, classes.data(), classes.size(), header.class_count, header.classes_offset);
+	write_section(out, fields.data(), fields.size(), header.field_count, header.fields_offset);
+	write_section(out, methods.data(), methods.size(), header.method_count, header.methods_offset);
+	write_section(out, arguments.data(), arguments.size(), header.argument_count, header.arguments_offset);
+	write_section(out, ranges.data(), ranges.size(), header.range_count, header.ranges_offset);
+	write_section(out, static_references.data(), static_references.size(),
+			header.static_reference_count, header.static_references_offset);
+	write_section(out, names.data(), names.size(), header.names_size, header.names_offset);
+	write_section(out, object_records.data(), object_records.size(), header.object_count, header.objects_offset);
+	write_section(out, relocations.data(), relocations.size(), header.relocation_count, header.relocations_offset);
+
+	//So that the heap section can be mapped as it is
+	write_padding(out, HEAP_PAGE_SIZE);
+	header.heap_offset = out.tellp();
+	header.heap_size = heap_image.size();
+	out.write(heap_image.data(), heap_image.size());
+
+	out.seekp(0);
+	out.write((const char*) &header, sizeof(header));
+	out.close();
+	return !out.fail();
+}
+
+unique_ptr<gc_context> gc_context::load_image(const string& path, void* stack_start,
+		const gc_config& config) {
+	ifstream in(path.c_str(), std::ios::binary);
+	gc_image_header header;
+	if (!in.read((char*) &header, sizeof(header)) ||
+			std::memcmp(header.magic, GC_IMAGE_MAGIC, sizeof(GC_IMAGE_MAGIC)) != 0 ||
+			header.version != GC_IMAGE_VERSION || header.pointer_size != sizeof(void*) ||
+			header.heap_unit_size != HEAP_UNIT_SIZE || header.heap_offset % HEAP_PAGE_SIZE != 0 ||
+#ifdef GC_COMPACT_HEADERS
+			header.compact_headers != 1 ||
+#else
+			header.compact_headers != 0 ||
+#endif
+#ifdef GC_COMPRESSED_REFERENCES
+			header.compressed_references != 1 ||
+#else
+			header.compressed_references != 0 ||
+#endif
+			header.heap_size % HEAP_PAGE_SIZE != 0) {
+		return nullptr;
+	}
+
+	vector<gc_image_type> types;
+	vector<gc_image_class> classes;
+	vector<gc_image_field> fields;
+	vector<gc_image_method> methods;
+	vector<uint32_t> arguments;
+	vector<gc_image_range> ranges;
+	vector<uint64_t> static_references;
+	vector<char> names;
+	vector<gc_image_object> objects;
+	vector<uint64_t> relocations;
+	if (!read_section(in, header.types_offset, header.type_count, types) ||
+			!read_section(in, header.classes_offset, header.class_count, classes) ||
+			!read_section(in, header.fields_offset, header.field_count, fields) ||
+			!read_section(in, header.methods_offset, header.method_count, methods) ||
+			!read_section(in, header.arguments_offset, header.argument_count, arguments) ||
+			!read_section(in, header.ranges_offset, header.range_count, ranges) ||
+			!read_section(in, header.static_references_offset, header.static_reference_count, static_references) ||
+			!read_section(in, header.names_offset, header.names_size, names) ||
+			!read_section(in, header.objects_offset, header.object_count, objects) ||
+			!read_section(in, header.relocations_offset, header.relocation_count, relocations)) {
+		return nullptr;
+	}
+	in.close();
+
+	unique_ptr<gc_type_store> store(new gc_type_store());
+	store->reorder_fields = header.reorder_fields != 0;
+
+	//An instance can't be larger than if it held every field in the image, each padded
+	uint64_t max_class_size = sizeof(core_representation) + fields.size() * 2 * sizeof(reference_t);
+	vector<class_type*> class_types;
+	for (const gc_image_class& record : classes) {
+		if (record.name_offset > names.size() || record.name_length > names.size() - record.name_offset ||
+				record.computed_size < sizeof(core_representation) || record.computed_size > max_class_size ||
+				uint64_t(record.first_field) + record.field_count > fields.size() ||
+				uint64_t(record.first_method) + record.method_count > methods.size() ||
+				uint64_t(record.first_range) + record.range_count > ranges.size() ||
+				uint64_t(record.first_static_reference) + record.static_reference_count > static_references.size() ||
+				(record.static_size > 0 && (record.static_size > header.heap_size ||
+					record.static_data_offset > header.heap_size - record.static_size ||
+					record.static_data_offset % HEAP_UNIT_SIZE != 0))) {
+			return nullptr;
+		}
+
+		unique_ptr<class_type> cls(new class_type());
+		cls->full_name.assign(names.data() + record.name_offset, record.name_length);
+		cls->base_type = nullptr;
+		cls->computed_size = record.computed_size;
+		cls->static_size = record.static_size;
+		cls->owned_type = nullptr;
+		cls->static_field_data = nullptr;
+
+		class_types.push_back(cls.get());
+		store->push_class_type(cls.get());
+		store->loaded_classes.push_back(std::move(cls));
+	}
+
+	//Content types always come first
+	vector<type_info*> type_infos;
+	for (const gc_image_type& record : types) {
+		switch (record.category) {
+		case TYPE_VOID:
+			type_infos.push_back(store->get_type_void());
+			break;
+		case TYPE_INT32:
+			type_infos.push_back(store->get_type_int32());
+			break;
+		case TYPE_ARRAY:
+			if (record.index >= type_infos.size()) {
+				return nullptr;
+			}
+			type_infos.push_back(store->get_type_array(type_infos[record.index]));
+			break;
+		case TYPE_CLASS_OBJECT:
+			if (record.index >= class_types.size()) {
+				return nullptr;
+			}
+			type_infos.push_back(store->get_class_type(class_types[record.index]));
+			break;
+		default:
+			return nullptr;
+		}
+	}
+	auto type_at = [&](uint32_t index) { return index < type_infos.size() ? type_infos[index] : nullptr; };
+
+	for (size_t i = 0; i < classes.size(); ++i) {
+		const gc_image_class& record = classes[i];
+		class_type* cls = class_types[i];
+
+		if (record.base_index != GC_IMAGE_NO_INDEX) {
+			if (record.base_index >= class_types.size()) {
+				return nullptr;
+			}
+			cls->base_type = class_types[record.base_index];
+		}
+
+		for (uint32_t f = record.first_field; f < record.first_field + record.field_count; ++f) {
+			field new_field;
+			new_field.type = type_at(fields[f].type_index);
+			new_field.flags.is_public = fields[f].is_public;
+			new_field.flags.is_static = fields[f].is_static;
+			new_field.field_offset = fields[f].field_offset;
+			uint64_t field_limit = new_field.flags.is_static ? record.static_size : record.computed_size;
+			if (!new_field.type || fields[f].field_offset > field_limit ||
+					field_limit - fields[f].field_offset < store->measure_direct_heap_size(new_field.type)) {
+				return nullptr;
+			}
+			cls->fields.push_back(new_field);
+		}
+
+		for (uint32_t m = record.first_method; m < record.first_method + record.method_count; ++m) {
+			const gc_image_method& method_record = methods[m];
+			if (uint64_t(method_record.first_argument) + method_record.argument_count > arguments.size()) {
+				return nullptr;
+			}
+
+			method new_method;
+			new_method.return_type = type_at(method_record.return_type_index);
+			new_method.flags.is_public = method_record.is_public;
+			new_method.flags.is_static = method_record.is_static;
+			new_method.flags.is_virtual = method_record.is_virtual;
+			new_method.virtual_offset = method_record.virtual_offset;
+			for (uint32_t a = 0; a < method_record.argument_count; ++a) {
+				new_method.arguments.push_back(type_at(arguments[method_record.first_argument + a]));
+				if (!new_method.arguments.back()) {
+					return nullptr;
+				}
+			}
+			if (!new_method.return_type) {
+				return nullptr;
+			}
+			cls->methods.push_back(new_method);
+		}
+
+		//Reference slots must lie within an instance or the static field data
+		for (uint32_t r = record.first_range; r < record.first_range + record.range_count; ++r) {
+			const gc_image_range& range = ranges[r];
+			if (range.offset < sizeof(core_representation) || range.offset % sizeof(reference_t) != 0 ||
+					range.offset > record.computed_size ||
+					range.count > (record.computed_size - range.offset) / sizeof(reference_t)) {
+				return nullptr;
+			}
+			cls->reference_ranges.push_back(reference_range{size_t(range.offset), size_t(range.count)});
+		}
+		for (uint32_t s = 0; s < record.static_reference_count; ++s) {
+			uint64_t offset = static_references[record.first_static_reference + s];
+			if (offset % sizeof(reference_t) != 0 || offset > record.static_size ||
+					record.static_size - offset < sizeof(reference_t)) {
+				return nullptr;
+			}
+			cls->static_reference_offsets.push_back(size_t(offset));
+		}
+	}
+
+	unique_ptr<gc_context> ctx(new gc_context(std::move(store), stack_start, config));
+	if (header.heap_size == 0) {
+		return ctx;
+	}
+
+	char* pages = (char*) map_file_pages(path.c_str(), header.heap_offset, size_t(header.heap_size),
+			(void*) (IMAGE_ADDRESS_BASE + uintptr_t(header.image_base)));
+	if (!pages) {
+		return nullptr;
+	}
+	//From here on, the heap owns the pages
+	gc_heap& heap = ctx->add_heap(gc_heap(pages, size_t(header.heap_size)));
+
+	//Static field data and objects may not overlap
+	auto reserve = [&](uint64_t offset, size_t size) {
+		size_t start = size_t(offset / HEAP_UNIT_SIZE);
+		size_t block_count = std::max(div_round_up(size, HEAP_UNIT_SIZE), size_t(1));
+		if (heap.heap_bitset.find_next_set(start, block_count) != heap.heap_bitset.size()) {
+			return false;
+		}
+		heap.heap_bitset.set_range(start, block_count);
+		return true;
+	};
+
+	for (size_t i = 0; i < classes.size(); ++i) {
+		if (classes[i].static_size > 0) {
+			class_types[i]->static_field_data = pages + classes[i].static_data_offset;
+			if (!reserve(classes[i].static_data_offset, size_t(classes[i].static_size))) {
+				return nullptr;
+			}
+		}
+	}
+
+	for (const gc_image_object& record : objects) {
+		type_info* type = type_at(record.type_index);
+		//Only classes and arrays can be measured as objects
+		if (!type || (type->type_category != TYPE_CLASS_OBJECT && type->type_category != TYPE_ARRAY) ||
+				record.offset % HEAP_UNIT_SIZE != 0 ||
+				record.offset > header.heap_size - sizeof(array_representation)) {
+			return nullptr;
+		}
+
+		//Sized so that measuring the object can't overflow, nor run past the heap
+		core_representation* object = (core_representation*) (pages + record.offset);
+		uint64_t room = header.heap_size - record.offset;
+		if (type->type_category == TYPE_ARRAY) {
+			size_t element_size = ctx->type_store->measure_direct_heap_size(((array_type_info*) type)->content_type);
+			if (element_size != 0 &&
+					((array_representation*) object)->array_length > (room - sizeof(array_representation)) / element_size) {
+				return nullptr;
+			}
+		}
+		else if (((class_type_info*) type)->cls->computed_size > room) {
+			return nullptr;
+		}
+
+		set_object_type(object, type);
+		if (!reserve(record.offset, ctx->type_store->measure_object_size(object))) {
+			return nullptr;
+		}
+		heap.heap_starts.set(record.offset / HEAP_UNIT_SIZE);
+	}
+
+	//Every reference must point at the start of an object, and be one of the relocated slots
+	vector<uint64_t> reference_slots;
+	bool dangling = false;
+	auto check_slot = [&](char* slot) {
+		reference_t value;
+		std::memcpy(&value, slot, sizeof(value));
+		if (value == 0) {
+			return;
+		}
+		uint64_t target = read_reference(slot) - header.image_base;
+		dangling |= target >= header.heap_size || target % HEAP_UNIT_SIZE != 0 ||
+				!heap.heap_starts.get(size_t(target / HEAP_UNIT_SIZE));
+		reference_slots.push_back(uint64_t(slot - pages));
+	};
+	for (size_t i = 0; i < classes.size(); ++i) {
+		for (size_t offset : class_types[i]->static_reference_offsets) {
+			check_slot(pages + classes[i].static_data_offset + offset);
+		}
+	}
+	for (const gc_image_object& record : objects) {
+		for_each_reference_slot((core_representation*) (pages + record.offset), [&](reference_t* slot) {
+			check_slot((char*) slot);
+		});
+	}
+	std::sort(reference_slots.begin(), reference_slots.end());
+	std::sort(relocations.begin(), relocations.end());
+	if (dangling || reference_slots != relocations) {
+		return nullptr;
+	}
+
+	//Only needed when the preferred address was taken
+	uint64_t delta = uintptr_t(pages) - IMAGE_ADDRESS_BASE - header.image_base;
+	if (delta != 0) {
+		for (uint64_t offset : relocations) {
+			write_reference(pages + offset, read_reference(pages + offset) + delta);
+		}
+	}
+
+	heap.rebuild_free_runs();
+	//The objects are young, so that a minor collection can free them
+	heap.allocated_since_gc = true;
+	return ctx;
+}
@@ -0,0 +1,124 @@
+#ifndef GC_IMAGE_H_
+#define GC_IMAGE_H_
+
+#include <cstdint>
+
+/**
+ * Heap images, written by gc_context::save_image and read by gc_context::load_image.
+ * The type store is stored as tables of fixed size records that refer to each other by
+ * index. The heap section is a gc_heap as it will be mapped: static field data first, then
+ * the objects, with references holding the address they would have if the section was
+ * mapped at image_base, in the form of a reference_t. The relocations list every non null reference slot, so that they
+ * can be adjusted when it is mapped elsewhere. Object headers hold a type index instead of
+ * a type_info*. Sections are 8 byte aligned, the heap section is page aligned.
+ */
+#define GC_IMAGE_MAGIC "GCIMAGE"
+#define GC_IMAGE_VERSION 3
+
+//Where images are meant to be mapped, away from where the OS maps things by itself.
+//With compressed references, image addresses are offsets in the reference space, away
+//from where alloc_pages starts.
+#if defined(GC_COMPRESSED_REFERENCES)
+#define GC_IMAGE_BASE 0x400000000
+#elif UINTPTR_MAX > 0xFFFFFFFF
+#define GC_IMAGE_BASE 0x200000000000
+#else
+#define GC_IMAGE_BASE 0x30000000
+#endif
+
+#define GC_IMAGE_NO_INDEX UINT32_MAX
+
+struct gc_image_header {
+	char magic[8];
+	uint32_t version;
+	//Images only load with the same pointer size, heap unit, field layout and headers
+	uint32_t pointer_size;
+	uint32_t heap_unit_size;
+	uint32_t reorder_fields;
+	//Set when built with GC_COMPACT_HEADERS, the type index then takes 32 bits
+	uint32_t compact_headers;
+	//Set when built with GC_COMPRESSED_REFERENCES, references are then reference_t
+	uint32_t compressed_references;
+	uint64_t image_base;
+	uint64_t type_count;
+	uint64_t types_offset;
+	uint64_t class_count;
+	uint64_t classes_offset;
+	uint64_t field_count;
+	uint64_t fields_offset;
+	uint64_t method_count;
+	uint64_t methods_offset;
+	uint64_t argument_count;
+	uint64_t arguments_offset;
+	uint64_t range_count;
+	uint64_t ranges_offset;
+	uint64_t static_reference_count;
+	uint64_t static_references_offset;
+	//Class names, not null terminated
+	uint64_t names_size;
+	uint64_t names_offset;
+	uint64_t object_count;
+	uint64_t objects_offset;
+	uint64_t relocation_count;
+	uint64_t relocations_offset;
+	uint64_t heap_size;
+	uint64_t heap_offset;
+};
+
+struct gc_image_type {
+	//A type_category_t
+	uint32_t category;
+	//Type index of the content for arrays, class index for classes
+	uint32_t index;
+};
+
+//first_* index into the field, method, range and static reference tables
+struct gc_image_class {
+	uint64_t name_offset;
+	uint32_t name_length;
+	uint32_t base_index;
+	uint64_t computed_size;
+	uint64_t static_size;
+	//In the heap section, only meaningful when static_size isn't 0
+	uint64_t static_data_offset;
+	uint32_t first_field;
+	uint32_t field_count;
+	uint32_t first_method;
+	uint32_t method_count;
+	uint32_t first_range;
+	uint32_t range_count;
+	uint32_t first_static_reference;
+	uint32_t static_reference_count;
+};
+
+struct gc_image_field {
+	uint64_t field_offset;
+	uint32_t type_index;
+	uint32_t is_public : 1;
+	uint32_t is_static : 1;
+};
+
+struct gc_image_method {
+	uint64_t virtual_offset;
+	uint32_t return_type_index;
+	uint32_t is_public : 1;
+	uint32_t is_static : 1;
+	uint32_t is_virtual : 1;
+	//Type indices in the argument table
+	uint32_t first_argument;
+	uint32_t argument_count;
+};
+
+struct gc_image_range {
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct gc_image_object {
+	//Offset in the heap section
+	uint64_t offset;
+	uint32_t type_index;
+	uint32_t padding;
+};
+
+#endif /* GC_IMAGE_H_ */
@@ -0,0 +1,457 @@
+#include "core.h"
+#include "gc_suite.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+//Mutators of the threads workload, the thread that runs the workload included
+#define SUITE_MUTATOR_THREADS 4
+
+/**
+ * A gc_context with the types shared by all workloads, and the number of bytes
+ * allocated through it. Node is { Node left; Node right; int32 value; }.
+ * It may be used by several registered threads at once.
+ */
+struct workload_env {
+	class_type node_class;
+	unique_ptr<gc_context> ctx;
+	gc_type_store* type_store;
+	type_info* node_type;
+	type_info* int_type;
+	const field* left;
+	const field* right;
+	const field* value;
+	std::atomic<size_t> allocated;
+	//Cleared when a workload finds a wrong value, which means the collector freed or moved something wrongly
+	std::atomic<bool> ok;
+
+	workload_env(void* stack_start, const gc_config& config) : allocated(0), ok(true) {
+		type_store = new gc_type_store();
+		type_store->reorder_fields = true;
+
+		node_class.full_name = "suite.Node";
+		node_class.base_type = nullptr;
+		node_class.owned_type = nullptr;
+		type_store->push_class_type(&node_class);
+		node_type = type_store->get_class_type(&node_class);
+		int_type = type_store->get_type_int32();
+
+		field node_left;
+		node_left.type = node_type;
+		node_left.flags.is_static = 0;
+		node_class.fields.push_back(node_left);
+
+		field node_right;
+		node_right.type = node_type;
+		node_right.flags.is_static = 0;
+		node_class.fields.push_back(node_right);
+
+		field node_value;
+		node_value.type = int_type;
+		node_value.flags.is_static = 0;
+		node_class.fields.push_back(node_value);
+
+		type_store->compute_sizes();
+		type_store->compute_static_sizes();
+
+		left = &node_class.fields[0];
+		right = &node_class.fields[1];
+		value = &node_class.fields[2];
+
+		ctx.reset(new gc_context(unique_ptr<gc_type_store>(type_store), stack_start, config));
+	}
+
+	core_representation* new_node(core_representation* l, core_representation* r, uint32_t v) {
+		core_representation* node = ctx->alloc_class(node_type);
+		allocated += node_class.computed_size;
+		ctx->store_field(node, *left, l);
+		ctx->store_field(node, *right, r);
+		set_value(node, v);
+		return node;
+	}
+
+	array_representation* new_array(type_info* content_type, size_t length) {
+		array_representation* array = ctx->alloc_array(content_type, length);
+		allocated += sizeof(array_representation) +
+				length * (content_type == int_type ? sizeof(uint32_t) : sizeof(reference_t));
+		return array;
+	}
+
+	uint32_t get_value(core_representation* node) const {
+		return *((uint32_t*) ((char*) node + value->field_offset));
+	}
+	void set_value(core_representation* node, uint32_t v) {
+		*((uint32_t*) ((char*) node + value->field_offset)) = v;
+	}
+
+	void check(bool condition) {
+		if (!condition) {
+			ok.store(false);
+		}
+	}
+};
+
+static core_representation* make_tree(workload_env& env, size_t depth) {
+	if (depth <= 1) {
+		return env.new_node(nullptr, nullptr, 1);
+	}
+	core_representation* l = make_tree(env, depth - 1);
+	core_representation* r = make_tree(env, depth - 1);
+	return env.new_node(l, r, 1);
+}
+
+static size_t count_tree(workload_env& env, core_representation* node) {
+	if (!node) {
+		return 0;
+	}
+	return env.get_value(node) + count_tree(env, env.ctx->load_field(node, *env.left)) +
+			count_tree(env, env.ctx->load_field(node, *env.right));
+}
+
+//The binary-trees benchmark: one long-lived tree, and many short-lived ones of growing depth
+static void workload_binary_trees(workload_env& env) {
+	const size_t max_depth = 16;
+
+	core_representation* volatile long_lived = make_tree(env, max_depth);
+	for (size_t depth = 4; depth <= max_depth; depth += 2) {
+		size_t iterations = size_t(1) << (max_depth - depth + 4);
+		for (size_t i = 0; i < iterations; ++i) {
+			env.check(count_tree(env, make_tree(env, depth)) == (size_t(1) << depth) - 1);
+		}
+	}
+	env.check(count_tree(env, long_lived) == (size_t(1) << max_depth) - 1);
+}
+
+//A FIFO queue of nodes: every node lives for the same number of operations
+static void workload_list_churn(workload_env& env) {
+	const size_t length = 100000;
+	const size_t operations = 4000000;
+
+	core_representation* head = env.new_node(nullptr, nullptr, 0);
+	core_representation* tail = head;
+	for (uint32_t i = 1; i < length; ++i) {
+		core_representation* node = env.new_node(nullptr, nullptr, i);
+		env.ctx->store_field(tail, *env.right, node);
+		tail = node;
+	}
+
+	for (uint32_t i = length; i < length + operations; ++i) {
+		env.check(env.get_value(head) == i - length);
+		head = env.ctx->load_field(head, *env.right);
+
+		core_representation* node = env.new_node(nullptr, nullptr, i);
+		env.ctx->store_field(tail, *env.right, node);
+		tail = node;
+	}
+}
+
+//Arrays of 4 KB to 1 MB, replaced in a ring of a few live ones: mostly large object space
+static void workload_array_churn(workload_env& env) {
+	const size_t ring_size = 16;
+	const size_t iterations = 20000;
+	std::mt19937 random(1);
+	std::uniform_int_distribution<size_t> lengths(1024, 256 * 1024);
+
+	type_info* int_array_type = env.type_store->get_type_array(env.int_type);
+	array_representation* ring = env.new_array(int_array_type, ring_size);
+	for (size_t i = 0; i < iterations; ++i) {
+		size_t slot = i % ring_size;
+		array_representation* old = (array_representation*) env.ctx->load_element(ring, slot);
+		if (old) {
+			uint32_t* content = (uint32_t*) old->content();
+			env.check(content[0] == i - ring_size && content[old->array_length - 1] == i - ring_size);
+		}
+
+		array_representation* array = env.new_array(env.int_type, lengths(random));
+		uint32_t* content = (uint32_t*) array->content();
+		content[0] = uint32_t(i);
+		content[array->array_length - 1] = uint32_t(i);
+		env.ctx->store_element(ring, slot, (core_representation*) array);
+	}
+}
+
+//Nodes replaced at random, half of them with an array of random size: holes of every size
+static void workload_fragmentation(workload_env& env) {
+	const size_t table_size = 65536;
+	const size_t operations = 4000000;
+	std::mt19937 random(2);
+	std::uniform_int_distribution<size_t> slots(0, table_size - 1);
+	std::uniform_int_distribution<size_t> lengths(1, 64);
+
+	array_representation* table = env.new_array(env.node_type, table_size);
+	vector<uint32_t> expected(table_size, 0);
+	for (uint32_t i = 1; i <= operations; ++i) {
+		size_t slot = slots(random);
+		core_representation* old = env.ctx->load_element(table, slot);
+		if (old) {
+			env.check(env.get_value(old) == expected[slot]);
+		}
+
+		core_representation* node = env.new_node(nullptr, nullptr, i);
+		if (i % 2) {
+			array_representation* array = env.new_array(env.int_type, lengths(random));
+			env.ctx->store_field(node, *env.left, (core_representation*) array);
+		}
+		expected[slot] = i;
+		env.ctx->store_element(table, slot, node);
+	}
+}
+
+//A large old structure that keeps getting young references, next to lots of garbage
+static void workload_mixed_lifetimes(workload_env& env) {
+	const size_t long_lived_count = 200000;
+	const size_t iterations = 100000;
+	std::mt19937 random(3);
+	std::uniform_int_distribution<size_t> slots(0, long_lived_count - 1);
+
+	array_representation* long_lived = env.new_array(env.node_type, long_lived_count);
+	for (uint32_t i = 0; i < long_lived_count; ++i) {
+		env.ctx->store_element(long_lived, i, env.new_node(nullptr, nullptr, i));
+	}
+
+	for (uint32_t i = 0; i < iterations; ++i) {
+		env.check(count_tree(env, make_tree(env, 6)) == 63);
+
+		if (i % 8 == 0) {
+			size_t slot = slots(random);
+			core_representation* node = env.ctx->load_element(long_lived, slot);
+			env.check(env.get_value(node) == slot);
+			env.ctx->store_field(node, *env.left, env.new_node(nullptr, nullptr, i));
+		}
+	}
+
+	for (uint32_t i = 0; i < long_lived_count; ++i) {
+		env.check(env.get_value(env.ctx->load_element(long_lived, i)) == i);
+	}
+}
+
+//One mutator of workload_threads: a queue of its own, and trees published in shared[index]
+static void __attribute__((noinline)) run_mutator(workload_env& env, array_representation* shared,
+		size_t index) {
+	const size_t length = 20000;
+	const size_t operations = 400000;
+	const size_t tree_depth = 8;
+
+	core_representation* head = env.new_node(nullptr, nullptr, 0);
+	core_representation* tail = head;
+	for (uint32_t i = 1; i < length; ++i) {
+		core_representation* node = env.new_node(nullptr, nullptr, i);
+		env.ctx->store_field(tail, *env.right, node);
+		tail = node;
+	}
+
+	for (uint32_t i = length; i < length + operations; ++i) {
+		env.check(env.get_value(head) == i - length);
+		head = env.ctx->load_field(head, *env.right);
+
+		core_representation* node = env.new_node(nullptr, nullptr, i);
+		env.ctx->store_field(tail, *env.right, node);
+		tail = node;
+
+		if (i % 1000 == 0) {
+			//Trees are complete before they are published, so another thread's one can be checked too
+			env.ctx->store_element(shared, index, make_tree(env, tree_depth));
+			core_representation* other = env.ctx->load_element(shared, (index + 1) % SUITE_MUTATOR_THREADS);
+			env.check(!other || count_tree(env, other) == (size_t(1) << tree_depth) - 1);
+		}
+		if (i % 20000 == 0) {
+			env.ctx->blocking_call([] { std::this_thread::yield(); });
+		}
+	}
+}
+
+//SUITE_MUTATOR_THREADS registered threads allocating and storing references at once
+static void workload_threads(workload_env& env) {
+	array_representation* shared = env.new_array(env.node_type, SUITE_MUTATOR_THREADS);
+
+	vector<std::thread> threads;
+	for (size_t i = 1; i < SUITE_MUTATOR_THREADS; ++i) {
+		threads.emplace_back([&env, shared, i] {
+			env.ctx->register_thread(get_stack_pointer());
+			run_mutator(env, shared, i);
+			env.ctx->unregister_thread();
+		});
+	}
+	run_mutator(env, shared, 0);
+	//The others may need a collection to finish
+	env.ctx->blocking_call([&threads] {
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	});
+
+	for (size_t i = 0; i < SUITE_MUTATOR_THREADS; ++i) {
+		core_representation* tree = env.ctx->load_element(shared, i);
+		env.check(tree && count_tree(env, tree) == 255);
+	}
+}
+
+struct workload {
+	const char* name;
+	void (*run)(workload_env& env);
+};
+
+static const workload workloads[] = {
+	{ "binary_trees", workload_binary_trees },
+	{ "list_churn", workload_list_churn },
+	{ "array_churn", workload_array_churn },
+	{ "fragmentation", workload_fragmentation },
+	{ "mixed_lifetimes", workload_mixed_lifetimes },
+	{ "threads", workload_threads },
+};
+
+static double percentile(const vector<double>& sorted, double fraction) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[size_t(fraction * (sorted.size() - 1) + 0.5)];
+}
+
+static size_t peak_rss_kb() {
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return size_t(usage.ru_maxrss);
+#endif
+}
+
+//Exit status of a workload process whose checks failed
+#define WORKLOAD_CHECK_FAILED 2
+
+//stack_start must belong to a caller, so that the references in our frames get scanned.
+//Returns false when the workload found a wrong value.
+static bool __attribute__((noinline)) run_workload(const workload& w, void* stack_start,
+		const gc_config& config) {
+	workload_env env(stack_start, config);
+
+	steady_clock::time_point start = steady_clock::now();
+	w.run(env);
+	duration<double> elapsed = steady_clock::now() - start;
+
+	vector<double> pauses = env.ctx->get_pause_times();
+	std::sort(pauses.begin(), pauses.end());
+	gc_stats stats = env.ctx->get_stats();
+
+	cout << std::fixed << std::setprecision(3)
+			<< "{\"workload\": \"" << w.name << "\""
+			<< ", \"ok\": " << (env.ok ? "true" : "false")
+			<< ", \"generational\": " << (config.generational ? "true" : "false")
+			<< ", \"compaction\": " << (config.compaction ? "true" : "false")
+			<< ", \"concurrent_mark\": " << (config.concurrent_mark ? "true" : "false")
+			<< ", \"mark_threads\": " << config.mark_threads
+			<< ", \"elapsed_ms\": " << (elapsed.count() * 1000)
+			<< ", \"allocated_mb\": " << (double(env.allocated) / (1 << 20))
+			<< ", \"alloc_mb_per_s\": " << (double(env.allocated) / (1 << 20) / elapsed.count())
+			<< ", \"full_gcs\": " << stats.full_collections
+			<< ", \"minor_gcs\": " << stats.minor_collections
+			<< ", \"reclaimed_mb\": " << (double(stats.bytes_reclaimed) / (1 << 20))
+			<< ", \"pauses\": " << stats.pauses
+			<< ", \"gc_pause_total_ms\": " << (stats.total_pause_time * 1000)
+			<< ", \"pause_p50_ms\": " << (percentile(pauses, 0.5) * 1000)
+			<< ", \"pause_p99_ms\": " << (percentile(pauses, 0.99) * 1000)
+			<< ", \"pause_max_ms\": " << (stats.max_pause_time * 1000)
+			<< ", \"root_scan_ms\": " << (stats.total_phases.root_scan * 1000)
+			<< ", \"static_scan_ms\": " << (stats.total_phases.static_scan * 1000)
+			<< ", \"mark_ms\": " << (stats.total_phases.mark * 1000)
+			<< ", \"compact_ms\": " << (stats.total_phases.compact * 1000)
+			<< ", \"sweep_ms\": " << (stats.total_phases.sweep * 1000)
+			<< ", \"heaps\": " << env.ctx->count_heaps()
+			<< ", \"heap_mb\": " << (double(env.ctx->total_heap_size()) / (1 << 20))
+			<< ", \"peak_rss_kb\": " << peak_rss_kb()
+			<< "}" << endl;
+	return env.ok;
+}
+
+int run_suite(int argc, char** argv) {
+	gc_config config;
+	vector<const workload*> selected;
+	for (int i = 0; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--generational") {
+			config.generational = true;
+		}
+		else if (arg == "--compaction") {
+			config.compaction = true;
+		}
+		else if (arg == "--concurrent") {
+			config.concurrent_mark = true;
+		}
+		else if (arg == "--no-lazy-sweep") {
+			config.lazy_sweep = false;
+		}
+		else if (arg == "--mark-threads" && i + 1 < argc) {
+			config.mark_threads = size_t(std::atoi(argv[++i]));
+		}
+		else {
+			const workload* found = nullptr;
+			for (const workload& w : workloads) {
+				if (arg == w.name) {
+					found = &w;
+				}
+			}
+			if (!found) {
+				cerr << "Unknown workload or option " << arg << endl;
+				return 1;
+			}
+			selected.push_back(found);
+		}
+	}
+	if (selected.empty()) {
+		for (const workload& w : workloads) {
+			selected.push_back(&w);
+		}
+	}
+
+	int result = 0;
+	for (const workload* w : selected) {
+#ifdef _WIN32
+		if (!run_workload(*w, get_stack_pointer(), config)) {
+			cerr << w->name << " failed its checks" << endl;
+			result = 1;
+		}
+#else
+		//A process per workload, so that the peak RSS is its own
+		cout.flush();
+		pid_t child = fork();
+		if (child == 0) {
+			bool ok = run_workload(*w, get_stack_pointer(), config);
+			cout.flush();
+			_exit(ok ? 0 : WORKLOAD_CHECK_FAILED);
+		}
+
+		int status = 0;
+		waitpid(child, &status, 0);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == WORKLOAD_CHECK_FAILED) {
+			cerr << w->name << " failed its checks" << endl;
+			result = 1;
+		}
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			cerr << w->name << " crashed" << endl;
+			result = 1;
+		}
+#endif
+	}
+	return result;
+}
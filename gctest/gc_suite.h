@@ -0,0 +1,14 @@
+#ifndef GC_SUITE_H_
+#define GC_SUITE_H_
+
+/**
+ * Standard GC workloads, run with the --suite command line argument.
+ * Each workload prints one JSON object per line, so that runs before and after a change
+ * can be compared by a script. args are the arguments after --suite: collector options
+ * (--generational, --compaction, --concurrent, --mark-threads N, --no-lazy-sweep),
+ * followed by the names of the workloads to run, all of them if none is given.
+ * Returns nonzero when a workload crashed or found a wrong value.
+ */
+int run_suite(int argc, char** argv);
+
+#endif /* GC_SUITE_H_ */
@@ -0,0 +1,161 @@
+#include "core.h"
+
+using std::mutex;
+using std::unique_lock;
+using std::lock_guard;
+
+thread_local std::vector<gc_context::thread_registration> gc_context::thread_registrations;
+thread_local gc_context::thread_registration gc_context::last_thread = {nullptr, nullptr};
+
+gc_thread* gc_context::find_current_thread() {
+	for (const thread_registration& registration : thread_registrations) {
+		if (registration.context == this) {
+			last_thread = registration;
+			return registration.thread;
+		}
+	}
+	return nullptr;
+}
+
+void gc_context::forget_current_thread() {
+	for (auto it = thread_registrations.begin(); it != thread_registrations.end(); ++it) {
+		if (it->context == this) {
+			thread_registrations.erase(it);
+			break;
+		}
+	}
+	if (last_thread.context == this) {
+		last_thread = {nullptr, nullptr};
+	}
+}
+
+void gc_context::register_thread(void* stack_start) {
+	lock_guard<mutex> guard(heap_lock);
+	threads.emplace_back(stack_start);
+	last_thread = {this, &threads.back()};
+	thread_registrations.push_back(last_thread);
+}
+
+void gc_context::unregister_thread() {
+	lock_heap();
+	lock_guard<mutex> guard(heap_lock, std::adopt_lock);
+
+	gc_thread* thread = current_thread();
+	retire_alloc_buffer(thread->buffer);
+	if (!thread->satb_buffer.empty()) {
+		{
+			lock_guard<mutex> satb_guard(satb_lock);
+			satb_queue.insert(satb_queue.end(), thread->satb_buffer.begin(), thread->satb_buffer.end());
+			marker_idle.store(false);
+		}
+		//Or the marker may sleep with the entries queued, and never become idle again
+		satb_ready.notify_one();
+	}
+
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		if (&*it == thread) {
+			threads.erase(it);
+			break;
+		}
+	}
+	forget_current_thread();
+}
+
+void gc_context::lock_heap() {
+	if (heap_lock.try_lock()) {
+		return;
+	}
+
+	//Someone else has the heap, and may collect while we wait. Our callers' registers
+	//go into this frame, so that they are on the part of the stack that gets scanned.
+	__builtin_unwind_init();
+	gc_thread* thread = current_thread();
+	thread->stack_pos = uintptr_t(get_stack_pointer());
+	{
+		lock_guard<mutex> guard(safepoint_lock);
+		thread->parked.store(true, std::memory_order_release);
+	}
+
+	heap_lock.lock();
+
+	lock_guard<mutex> guard(safepoint_lock);
+	thread->parked.store(false, std::memory_order_release);
+}
+
+void gc_context::stop_at_safepoint() {
+	__builtin_unwind_init();
+	gc_thread* thread = current_thread();
+	thread->stack_pos = uintptr_t(get_stack_pointer());
+
+	unique_lock<mutex> guard(safepoint_lock);
+	thread->parked.store(true, std::memory_order_release);
+	while (safepoint_requested.load()) {
+		safepoint_over.wait(guard);
+	}
+	thread->parked.store(false, std::memory_order_release);
+}
+
+void gc_context::stop_the_world() {
+	//Collections may nest, e.g. when a concurrent cycle is finished by an explicit one
+	if (world_stops++ > 0) {
+		return;
+	}
+	pause_start = std::chrono::steady_clock::now();
+	if (threads.size() == 1) {
+		return;
+	}
+
+	{
+		lock_guard<mutex> guard(safepoint_lock);
+		safepoint_requested.store(true);
+	}
+
+	gc_thread* self = current_thread();
+	for (const gc_thread& thread : threads) {
+		if (&thread == self) {
+			continue;
+		}
+		//Threads get here quickly unless they run for long without allocating
+		while (!thread.parked.load(std::memory_order_acquire)) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void gc_context::resume_the_world() {
+	if (--world_stops > 0) {
+		return;
+	}
+	double pause = seconds_since(pause_start);
+	pause_times.push_back(pause);
+	++stats.pauses;
+	stats.total_pause_time += pause;
+	if (pause > stats.max_pause_time) {
+		stats.max_pause_time = pause;
+	}
+
+	{
+		lock_guard<mutex> guard(safepoint_lock);
+		safepoint_requested.store(false);
+	}
+	safepoint_over.notify_all();
+}
+
+void gc_context::blocking_call(const std::function<void()>& call) {
+	__builtin_unwind_init();
+	gc_thread* thread = current_thread();
+	thread->stack_pos = uintptr_t(get_stack_pointer());
+	{
+		lock_guard<mutex> guard(safepoint_lock);
+		thread->parked.store(true, std::memory_order_release);
+	}
+
+	call();
+
+	//A collection that stopped us must be over before we touch the heap again
+	unique_lock<mutex> guard(safepoint_lock);
+	while (safepoint_requested.load()) {
+		safepoint_over.wait(guard);
+	}
+	thread->parked.store(false, std::memory_order_release);
+}
@@ -1,6 +1,7 @@
 #include "core.h"
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
 #include "utils.h"
 
 using std::cout;
@@ -9,11 +10,63 @@ using std::endl;
 using std::string;
 using std::abort;
 using std::malloc;
+using std::free;
+
+std::atomic<type_info**> type_table::chunks[TYPE_ID_CHUNK_COUNT];
+uint32_t type_table::type_count = 0;
+std::vector<uint32_t> type_table::free_ids;
+std::mutex type_table::lock;
+
+void type_table::add(type_info* type) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!free_ids.empty()) {
+		type->type_id = free_ids.back();
+		free_ids.pop_back();
+		chunks[type->type_id >> TYPE_ID_CHUNK_BITS].load(std::memory_order_relaxed)
+				[type->type_id & ((1 << TYPE_ID_CHUNK_BITS) - 1)] = type;
+		return;
+	}
+
+	size_t chunk = type_count >> TYPE_ID_CHUNK_BITS;
+	if (chunk >= TYPE_ID_CHUNK_COUNT) {
+		cerr << "Too many types" << endl;
+		abort();
+	}
+	if (!chunks[chunk].load(std::memory_order_relaxed)) {
+		chunks[chunk].store(new type_info*[1 << TYPE_ID_CHUNK_BITS], std::memory_order_release);
+	}
+
+	type->type_id = type_count++;
+	chunks[chunk].load(std::memory_order_relaxed)[type->type_id & ((1 << TYPE_ID_CHUNK_BITS) - 1)] = type;
+}
+
+void type_table::remove(const type_info* type) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	chunks[type->type_id >> TYPE_ID_CHUNK_BITS].load(std::memory_order_relaxed)
+			[type->type_id & ((1 << TYPE_ID_CHUNK_BITS) - 1)] = nullptr;
+	free_ids.push_back(type->type_id);
+}
 
-gc_type_store::gc_type_store() {
+gc_type_store::gc_type_store() : reorder_fields(false) {
 	for (size_t i = 0; i <= LAST_PRIMITIVE_TYPE; ++i) {
 		primitive_types[i].type_category = type_category_t(i);
 		primitive_types[i].array_type = nullptr;
+		type_table::add(&primitive_types[i]);
+	}
+}
+
+gc_type_store::~gc_type_store() {
+	for (class_type* cls : class_types) {
+		cls->owned_type = nullptr;
+	}
+	for (type_info& type : primitive_types) {
+		type_table::remove(&type);
+	}
+	for (type_info* type : created_types) {
+		type_table::remove(type);
+		free(type);
 	}
 }
 
@@ -35,6 +88,8 @@ type_info* gc_type_store::get_type_array(type_info* base_type) {
 	type->base_type.type_category = TYPE_ARRAY;
 	type->base_type.array_type = nullptr;
 	type->content_type = base_type;
+	type_table::add(&type->base_type);
+	created_types.push_back(&type->base_type);
 
 	base_type->array_type = (type_info*) type;
 
@@ -51,6 +106,8 @@ type_info* gc_type_store::get_class_type(class_type* cls) {
 	type->base_type.type_category = TYPE_CLASS_OBJECT;
 	type->base_type.array_type = nullptr;
 	type->cls = cls;
+	type_table::add(&type->base_type);
+	created_types.push_back(&type->base_type);
 
 	cls->owned_type = (type_info*) type;
 
@@ -62,26 +119,44 @@ size_t gc_type_store::full_compute_class_size(class_type* cls) {
 
 	if (cls->base_type) {
 		size = full_compute_class_size(cls->base_type);
+		cls->reference_ranges = cls->base_type->reference_ranges;
 	}
 	else {
 		size = sizeof(core_representation);
+		cls->reference_ranges.clear();
 	}
 
+	std::vector<field*> layout;
 	for (field& field : cls->fields) {
-		if (field.flags.is_static) {
-			continue;
+		if (!field.flags.is_static) {
+			layout.push_back(&field);
+		}
+	}
+	if (reorder_fields) {
+		auto first_int = std::stable_partition(layout.begin(), layout.end(), [](const field* f) {
+			return f->type->type_category == TYPE_ARRAY || f->type->type_category == TYPE_CLASS_OBJECT;
+		});
+		if (size % sizeof(reference_t) != 0 && first_int != layout.end()) {
+			//The base class ends with an int32, the gap after it fits one of ours
+			std::rotate(layout.begin(), first_int, first_int + 1);
 		}
+	}
+
+	for (field* pfield : layout) {
+		field& field = *pfield;
 
 		switch (field.type->type_category) {
 		case TYPE_ARRAY:
-			size = align(size, sizeof(void*));
+			size = align(size, sizeof(reference_t));
 			field.field_offset = size;
-			size += sizeof(void*);
+			add_reference_slot(cls, size);
+			size += sizeof(reference_t);
 			break;
 		case TYPE_CLASS_OBJECT:
-			size = align(size, sizeof(void*));
+			size = align(size, sizeof(reference_t));
 			field.field_offset = size;
-			size += sizeof(void*);
+			add_reference_slot(cls, size);
+			size += sizeof(reference_t);
 			break;
 		case TYPE_INT32:
 			size = align(size, sizeof(uint32_t));
@@ -98,6 +173,16 @@ size_t gc_type_store::full_compute_class_size(class_type* cls) {
 	return size;
 }
 
+void gc_type_store::add_reference_slot(class_type* cls, size_t offset) {
+	std::vector<reference_range>& ranges = cls->reference_ranges;
+	if (!ranges.empty() && ranges.back().offset + ranges.back().count * sizeof(reference_t) == offset) {
+		++ranges.back().count;
+	}
+	else {
+		ranges.push_back(reference_range{offset, 1});
+	}
+}
+
 void gc_type_store::compute_sizes() {
 	for (class_type* cls : class_types) {
 		cls->computed_size = full_compute_class_size(cls);
@@ -106,6 +191,7 @@ void gc_type_store::compute_sizes() {
 
 size_t gc_type_store::full_compute_class_static_size(class_type* cls) {
 	size_t size = 0;
+	cls->static_reference_offsets.clear();
 
 	for (field& field : cls->fields) {
 		if (!field.flags.is_static) {
@@ -114,14 +200,16 @@ size_t gc_type_store::full_compute_class_static_size(class_type* cls) {
 
 		switch (field.type->type_category) {
 		case TYPE_ARRAY:
-			size = align(size, sizeof(void*));
+			size = align(size, sizeof(reference_t));
 			field.field_offset = size;
-			size += sizeof(void*);
+			cls->static_reference_offsets.push_back(size);
+			size += sizeof(reference_t);
 			break;
 		case TYPE_CLASS_OBJECT:
-			size = align(size, sizeof(void*));
+			size = align(size, sizeof(reference_t));
 			field.field_offset = size;
-			size += sizeof(void*);
+			cls->static_reference_offsets.push_back(size);
+			size += sizeof(reference_t);
 			break;
 		case TYPE_INT32:
 			size = align(size, sizeof(uint32_t));
@@ -144,36 +232,104 @@ void gc_type_store::compute_static_sizes() {
 	}
 }
 
-class_type* gc_type_store::class_by_name(string class_name) {
-	for (class_type* cls : class_types) {
-		if (cls->full_name == class_name) {
-			return cls;
+void gc_type_store::push_class_type(class_type* type) {
+	type->class_id = uint32_t(class_types.size());
+	class_types.push_back(type);
+
+	if (class_types.size() * 2 > class_index.size()) {
+		//Rebuilt twice as large, in id order so that the first of equal names stays first
+		class_index.assign(std::max(class_index.size() * 2, size_t(64)), NO_CLASS_ID);
+		for (uint32_t id = 0; id < class_types.size(); ++id) {
+			index_class(id);
 		}
 	}
+	else {
+		index_class(type->class_id);
+	}
+}
+
+//FNV-1a
+size_t gc_type_store::hash_name(const char* name, size_t length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i) {
+		hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+	}
+	return size_t(hash ^ (hash >> 32));
+}
 
-	cerr << "Class not found" << endl;
-	abort();
+void gc_type_store::index_class(uint32_t id) {
+	const string& name = class_types[id]->full_name;
+	if (find_class_id(name.data(), name.size()) != NO_CLASS_ID) {
+		return;
+	}
+
+	size_t mask = class_index.size() - 1;
+	size_t slot = hash_name(name.data(), name.size()) & mask;
+	while (class_index[slot] != NO_CLASS_ID) {
+		slot = (slot + 1) & mask;
+	}
+	class_index[slot] = id;
 }
 
-const class_type* gc_type_store::class_by_name(string class_name) const {
-	for (const class_type* cls : class_types) {
-		if (cls->full_name == class_name) {
-			return cls;
+uint32_t gc_type_store::find_class_id(const char* name, size_t length) const {
+	if (class_index.empty()) {
+		return NO_CLASS_ID;
+	}
+
+	size_t mask = class_index.size() - 1;
+	for (size_t slot = hash_name(name, length) & mask; class_index[slot] != NO_CLASS_ID;
+			slot = (slot + 1) & mask) {
+		const string& candidate = class_types[class_index[slot]]->full_name;
+		if (candidate.size() == length && candidate.compare(0, length, name, length) == 0) {
+			return class_index[slot];
 		}
 	}
+	return NO_CLASS_ID;
+}
 
-	cerr << "Class not found" << endl;
-	abort();
+class_type* gc_type_store::find_class(const char* name, size_t length) {
+	return class_by_id(find_class_id(name, length));
+}
+
+class_type* gc_type_store::class_by_name(const char* name, size_t length) {
+	return const_cast<class_type*>(((const gc_type_store*) this)->class_by_name(name, length));
+}
+
+const class_type* gc_type_store::class_by_name(const char* name, size_t length) const {
+	const class_type* cls = class_by_id(find_class_id(name, length));
+	if (!cls) {
+		cerr << "Class not found" << endl;
+		abort();
+	}
+	return cls;
 }
 
-size_t gc_type_store::measure_class_size(type_info* type) const {
-	return ((class_type_info*) type)->cls->computed_size;
+class_type* gc_type_store::class_by_name(const string& class_name) {
+	return class_by_name(class_name.data(), class_name.size());
 }
 
-size_t gc_type_store::measure_direct_heap_size(type_info* type) const {
+const class_type* gc_type_store::class_by_name(const string& class_name) const {
+	return class_by_name(class_name.data(), class_name.size());
+}
+
+size_t gc_type_store::measure_class_size(const type_info* type) const {
+	return ((const class_type_info*) type)->cls->computed_size;
+}
+
+size_t gc_type_store::measure_object_size(const core_representation* object) const {
+	const type_info* type = object_type(object);
+	if (type->type_category == TYPE_ARRAY) {
+		const array_representation* array = (const array_representation*) object;
+		return measure_array_size(((const array_type_info*) type)->content_type, array->array_length);
+	}
+	return measure_class_size(type);
+}
+
+size_t gc_type_store::measure_direct_heap_size(const type_info* type) const {
 	switch (type->type_category) {
-	case TYPE_CLASS_OBJECT: return sizeof(core_representation);
-	case TYPE_ARRAY: return sizeof(array_representation);
+	//References
+	case TYPE_CLASS_OBJECT: return sizeof(reference_t);
+	case TYPE_ARRAY: return sizeof(reference_t);
 	case TYPE_INT32: return sizeof(uint32_t);
 	case TYPE_VOID: return 0;
 	}
@@ -182,10 +338,26 @@ size_t gc_type_store::measure_direct_heap_size(type_info* type) const {
 	abort();
 }
 
-size_t gc_type_store::measure_array_content_size(type_info* content_type, size_t len) const {
+size_t gc_type_store::measure_array_content_size(const type_info* content_type, size_t len) const {
 	return len * measure_direct_heap_size(content_type);
 }
 
+size_t gc_type_store::measure_array_size(const type_info* content_type, size_t len) const {
+	return sizeof(array_representation) + measure_array_content_size(content_type, len);
+}
+
+string gc_type_store::type_name(const type_info* type) const {
+	switch (type->type_category) {
+	case TYPE_CLASS_OBJECT: return ((const class_type_info*) type)->cls->full_name;
+	case TYPE_ARRAY: return type_name(((const array_type_info*) type)->content_type) + "[]";
+	case TYPE_INT32: return "int32";
+	case TYPE_VOID: return "void";
+	}
+
+	cerr << "type_name Unrecognized type " << type->type_category << endl;
+	abort();
+}
+
 void gc_type_store::log_headers() {
 	for (class_type* cls : class_types) {
 		cout << "full_name=" << cls->full_name << endl;
@@ -0,0 +1,63 @@
+#include "gc_workers.h"
+
+using std::mutex;
+using std::unique_lock;
+
+gc_worker_pool::gc_worker_pool(size_t thread_count) : task_id(0), running(0), stopping(false) {
+	for (size_t i = 1; i < thread_count; ++i) {
+		threads.push_back(std::thread(&gc_worker_pool::worker_loop, this, i));
+	}
+}
+
+gc_worker_pool::~gc_worker_pool() {
+	{
+		unique_lock<mutex> guard(lock);
+		stopping = true;
+	}
+	task_ready.notify_all();
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void gc_worker_pool::run(const std::function<void(size_t)>& task) {
+	{
+		unique_lock<mutex> guard(lock);
+		this->task = task;
+		running = threads.size();
+		++task_id;
+	}
+	task_ready.notify_all();
+
+	task(0);
+
+	unique_lock<mutex> guard(lock);
+	while (running > 0) {
+		task_done.wait(guard);
+	}
+	this->task = nullptr;
+}
+
+void gc_worker_pool::worker_loop(size_t index) {
+	size_t last_task = 0;
+
+	unique_lock<mutex> guard(lock);
+	for (;;) {
+		while (!stopping && task_id == last_task) {
+			task_ready.wait(guard);
+		}
+		if (stopping) {
+			return;
+		}
+
+		last_task = task_id;
+		guard.unlock();
+		task(index);
+		guard.lock();
+
+		if (--running == 0) {
+			task_done.notify_one();
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef GC_WORKERS_H_
+#define GC_WORKERS_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstddef>
+
+/**
+ * Threads kept around to help with collections. run() hands the same task to every
+ * worker and to the calling thread, and returns once all of them are done.
+ */
+class gc_worker_pool {
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable task_ready;
+	std::condition_variable task_done;
+	std::function<void(size_t)> task;
+	//Incremented for each task, so that workers don't run the same one twice
+	size_t task_id;
+	size_t running;
+	bool stopping;
+
+	void worker_loop(size_t index);
+public:
+	//thread_count includes the calling thread, so thread_count - 1 threads are started
+	gc_worker_pool(size_t thread_count);
+	gc_worker_pool(const gc_worker_pool& other) = delete;
+	~gc_worker_pool();
+
+	size_t size() const { return threads.size() + 1; }
+
+	//Calls task(index) for every index below size(), index 0 on the calling thread
+	void run(const std::function<void(size_t)>& task);
+};
+
+#endif /* GC_WORKERS_H_ */
@@ -1,5 +1,9 @@
 #include "core.h"
+#include "gc_bench.h"
+#include "gc_suite.h"
+#include "gc_dump.h"
 #include <iostream>
+#include <cstring>
 
 using std::cout;
 using std::cerr;
@@ -15,17 +19,15 @@ void test_linked_list() {
 	const field& fnext = cls->fields[1];
 	const field& fval = cls->fields[2];
 
-	size_t oprev = fprev.field_offset;
-	size_t onext = fnext.field_offset;
 	size_t oval = fval.field_offset;
 
 	void* e1 = 0;
 
 	for (int i = 0; i < 1000; ++i) {
-		void* first = 0;
-		void* prev = 0;
+		core_representation* first = 0;
+		core_representation* prev = 0;
 		for (int j = 0; j < 15000; ++j) {
-			void* node = ctx->alloc_class(cls_type);
+			core_representation* node = ctx->alloc_class(cls_type);
 			if (!first) {
 				first = node;
 				if (!e1) {
@@ -33,12 +35,12 @@ void test_linked_list() {
 				}
 			}
 			else {
-				*((void**) ((char*) node + oprev)) = prev;
+				ctx->store_field(node, fprev, prev);
 				if (prev) {
-					*((void**) ((char*) prev + onext)) = node;
+					ctx->store_field(prev, fnext, node);
 				}
 			}
-			*((void**) ((char*) node + onext)) = nullptr;
+			ctx->store_field(node, fnext, nullptr);
 			*((uint32_t*) ((char*) node + oval)) = j + 1;
 			prev = node;
 		}
@@ -46,7 +48,7 @@ void test_linked_list() {
 		//cout << "Test:" << endl;
 
 		uint32_t pval = 0;
-		for (void* celem = first; celem; celem = *((void**) ((char*) celem + onext))) {
+		for (core_representation* celem = first; celem; celem = ctx->load_field(celem, fnext)) {
 			if (*((uint32_t*) ((char*) celem + oval)) != pval + 1) {
 				cerr << "WRONG RESULTS. Got " << *((uint32_t*) ((char*) celem + oval)) << endl;
 			}
@@ -65,11 +67,11 @@ void test_array() {
 		}
 
 		for (size_t j = 0; j < array->array_length; ++j) {
-			((uint32_t*) array->content)[j] = j;
+			((uint32_t*) array->content())[j] = j;
 		}
 
 		for (size_t j = 0; j < array->array_length; ++j) {
-			uint32_t val = ((uint32_t*) array->content)[j];
+			uint32_t val = ((uint32_t*) array->content())[j];
 			if (val != j) {
 				cerr << "WRONG RESULTS. Got " << val << endl;
 			}
@@ -77,7 +79,7 @@ void test_array() {
 	}
 
 	for (size_t j = 0; j < first->array_length; ++j) {
-		uint32_t val = ((uint32_t*) first->content)[j];
+		uint32_t val = ((uint32_t*) first->content())[j];
 		if (val != j) {
 			cerr << "WRONG RESULTS. Got " << val << endl;
 		}
@@ -93,29 +95,64 @@ void test_statics(bool check_old) {
 
 	size_t oval = fval.field_offset;
 	size_t osomething = fsomething.field_offset;
-	size_t oNotableLink = fNotableLink.field_offset;
 
 	void* static_data = cls->static_field_data;
 
 	if (check_old) {
-		void* node = *((void**) ((char*) static_data + oNotableLink));
+		void* node = ctx->load_static(cls, fNotableLink);
 		uint32_t* val = (uint32_t*)((char*) node + oval);
 		cout << "Old value was " << *val << endl;
 		*val = 123;
 	}
 
-	void* node = ctx->alloc_class(cls_type);
+	core_representation* node = ctx->alloc_class(cls_type);
 
 	*((uint32_t*) ((char*) static_data + osomething)) = 0x12345678;
-	*((void**) ((char*) static_data + oNotableLink)) = node;
+	ctx->store_static(cls, fNotableLink, node);
 
 	uint32_t* val = (uint32_t*)((char*) node + oval);
 	*val = 123;
 }
 
-int main() {
+int main(int argc, char** argv) {
+	if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) {
+		run_benchmarks();
+		return 0;
+	}
+	if (argc > 1 && std::strcmp(argv[1], "--suite") == 0) {
+		return run_suite(argc - 2, argv + 2);
+	}
+	if (argc > 1 && std::strcmp(argv[1], "--analyze") == 0) {
+		return run_dump_analyzer(argc - 2, argv + 2);
+	}
+	//Runs the tests, then dumps or saves what is left
+	const char* dump_path = argc > 2 && std::strcmp(argv[1], "--dump") == 0 ? argv[2] : nullptr;
+	const char* image_path = argc > 2 && std::strcmp(argv[1], "--save-image") == 0 ? argv[2] : nullptr;
+
 	type_store = new gc_type_store();
-	ctx = new gc_context(std::unique_ptr<gc_type_store>(type_store), get_stack_pointer());
+	type_store->reorder_fields = true;
+	gc_config config;
+	config.generational = true;
+	config.compaction = true;
+
+	if (argc > 2 && std::strcmp(argv[1], "--load-image") == 0) {
+		//Starts where --save-image left off
+		ctx = gc_context::load_image(argv[2], get_stack_pointer(), config).release();
+		if (!ctx) {
+			cerr << "Can't load the image " << argv[2] << endl;
+			return 1;
+		}
+		type_store = ctx->get_type_store();
+
+		cout << "Statics from the image" << endl;
+		test_statics(true);
+		cout << "Now list" << endl;
+		test_linked_list();
+		cout << ctx->count_heaps() << endl;
+		return 0;
+	}
+
+	ctx = new gc_context(std::unique_ptr<gc_type_store>(type_store), get_stack_pointer(), config);
 
 	class_type core_Link;
 	core_Link.full_name = "core.Link";
@@ -166,6 +203,15 @@ int main() {
 
 	cout << ctx->count_heaps() << endl;
 
+	if (dump_path && !ctx->dump_heap(dump_path)) {
+		cerr << "Can't write the heap dump to " << dump_path << endl;
+		return 1;
+	}
+	if (image_path && !ctx->save_image(image_path)) {
+		cerr << "Can't write the image to " << image_path << endl;
+		return 1;
+	}
+
 	cout.flush();
 	cerr.flush();
 }
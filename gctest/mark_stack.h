@@ -0,0 +1,98 @@
+#ifndef MARK_STACK_H_
+#define MARK_STACK_H_
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+
+struct core_representation;
+
+/**
+ * Objects waiting to be traced by one marking thread.
+ * The owner pushes and pops on a private stack. When work sharing is enabled and the
+ * private stack gets big, its oldest half is published, and other threads can steal
+ * from the published part. Only that part needs the lock.
+ * Popped objects go through a short FIFO first, and are prefetched when they enter it,
+ * so that they are usually in the cache by the time they are traced.
+ */
+class mark_stack {
+	static const size_t PUBLISH_THRESHOLD = 64;
+	static const size_t INITIAL_CAPACITY = 4096;
+	static const size_t PREFETCH_DISTANCE = 8;
+
+	std::vector<core_representation*> local;
+	core_representation* prefetched[PREFETCH_DISTANCE];
+	size_t prefetch_head;
+	size_t prefetch_count;
+	std::vector<core_representation*> shared;
+	std::atomic<size_t> shared_size;
+	std::mutex shared_lock;
+	bool sharing;
+
+	void publish() {
+		size_t count = local.size() / 2;
+
+		std::lock_guard<std::mutex> guard(shared_lock);
+		//The oldest entries are the closest to the roots, so they are likely to lead to the most work
+		shared.insert(shared.end(), local.begin(), local.begin() + count);
+		local.erase(local.begin(), local.begin() + count);
+		shared_size.store(shared.size(), std::memory_order_release);
+	}
+public:
+	mark_stack() : prefetch_head(0), prefetch_count(0), shared_size(0), sharing(false) {
+		local.reserve(INITIAL_CAPACITY);
+	}
+	mark_stack(const mark_stack& other) = delete;
+
+	void set_sharing(bool enabled) { sharing = enabled; }
+
+	inline void push(core_representation* object) {
+		local.push_back(object);
+		if (sharing && local.size() >= PUBLISH_THRESHOLD &&
+				shared_size.load(std::memory_order_relaxed) == 0) {
+			publish();
+		}
+	}
+
+	inline bool pop(core_representation*& object) {
+		while (prefetch_count < PREFETCH_DISTANCE && !local.empty()) {
+			core_representation* next = local.back();
+			local.pop_back();
+			__builtin_prefetch(next);
+			prefetched[(prefetch_head + prefetch_count) % PREFETCH_DISTANCE] = next;
+			++prefetch_count;
+		}
+
+		if (prefetch_count == 0) {
+			return false;
+		}
+		object = prefetched[prefetch_head];
+		prefetch_head = (prefetch_head + 1) % PREFETCH_DISTANCE;
+		--prefetch_count;
+		return true;
+	}
+
+	inline bool has_shared() const { return shared_size.load(std::memory_order_acquire) > 0; }
+
+	//Moves half of what victim published (which may be this stack) to our private stack
+	bool steal_from(mark_stack& victim) {
+		if (!victim.has_shared()) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> guard(victim.shared_lock);
+		size_t available = victim.shared.size();
+		if (available == 0) {
+			return false;
+		}
+
+		size_t count = (available + 1) / 2;
+		local.insert(local.end(), victim.shared.end() - count, victim.shared.end());
+		victim.shared.resize(available - count);
+		victim.shared_size.store(victim.shared.size(), std::memory_order_release);
+		return true;
+	}
+};
+
+#endif /* MARK_STACK_H_ */
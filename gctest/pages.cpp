@@ -0,0 +1,236 @@
+#include "pages.h"
+#ifdef GC_COMPRESSED_REFERENCES
+#include <map>
+#include <mutex>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <fstream>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#define HEAP_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+#ifdef MAP_POPULATE
+#define POPULATE_MAP_FLAG(populate) ((populate) ? MAP_POPULATE : 0)
+#else
+#define POPULATE_MAP_FLAG(populate) 0
+#endif
+
+//Touching a mapped page past the end of the file raises SIGBUS, so short files are refused
+static bool file_covers(int fd, uint64_t offset, size_t size) {
+	struct stat status;
+	return fstat(fd, &status) == 0 && uint64_t(status.st_size) >= offset &&
+			uint64_t(status.st_size) - offset >= size;
+}
+#endif
+
+#ifdef GC_COMPRESSED_REFERENCES
+char* reference_space_base = nullptr;
+
+/**
+ * Free ranges of the reference space, by offset, coalesced. Pages are committed when they
+ * are handed out, and decommitted when they come back.
+ */
+static std::map<size_t, size_t> reference_space_free;
+static std::mutex reference_space_lock;
+
+static bool reserve_reference_space() {
+	if (reference_space_base) {
+		return true;
+	}
+#ifdef _WIN32
+	void* space = VirtualAlloc(nullptr, REFERENCE_SPACE_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* space = mmap(nullptr, REFERENCE_SPACE_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (space == MAP_FAILED) {
+		space = nullptr;
+	}
+#endif
+	if (!space) {
+		return false;
+	}
+	reference_space_free[HEAP_PAGE_SIZE] = REFERENCE_SPACE_SIZE - HEAP_PAGE_SIZE;
+	__atomic_store_n(&reference_space_base, (char*) space, __ATOMIC_RELEASE);
+	return true;
+}
+
+//Takes [offset, offset + size) out of the free ranges, it must be part of one
+static void take_reference_range(std::map<size_t, size_t>::iterator range, size_t offset, size_t size) {
+	size_t range_start = range->first;
+	size_t range_end = range->first + range->second;
+	reference_space_free.erase(range);
+	if (range_start < offset) {
+		reference_space_free[range_start] = offset - range_start;
+	}
+	if (offset + size < range_end) {
+		reference_space_free[offset + size] = range_end - offset - size;
+	}
+}
+
+/**
+ * Reserves size bytes of the reference space, at preferred when that range is free and
+ * preferred isn't null, or else at the first range that fits. Returns null when full.
+ */
+static char* take_reference_pages(size_t size, const void* preferred) {
+	std::lock_guard<std::mutex> guard(reference_space_lock);
+	if (!reserve_reference_space()) {
+		return nullptr;
+	}
+
+	uintptr_t preferred_offset = uintptr_t(preferred) - uintptr_t(reference_space_base);
+	if (preferred && uintptr_t(preferred) >= uintptr_t(reference_space_base) &&
+			preferred_offset <= REFERENCE_SPACE_SIZE - size) {
+		auto range = reference_space_free.upper_bound(preferred_offset);
+		if (range != reference_space_free.begin()) {
+			--range;
+			if (range->first + range->second >= preferred_offset + size) {
+				take_reference_range(range, preferred_offset, size);
+				return reference_space_base + preferred_offset;
+			}
+		}
+	}
+
+	for (auto range = reference_space_free.begin(); range != reference_space_free.end(); ++range) {
+		if (range->second >= size) {
+			size_t offset = range->first;
+			take_reference_range(range, offset, size);
+			return reference_space_base + offset;
+		}
+	}
+	return nullptr;
+}
+
+static void give_back_reference_pages(char* pages, size_t size) {
+	std::lock_guard<std::mutex> guard(reference_space_lock);
+
+	size_t offset = pages - reference_space_base;
+	auto next = reference_space_free.lower_bound(offset);
+	if (next != reference_space_free.end() && next->first == offset + size) {
+		size += next->second;
+		next = reference_space_free.erase(next);
+	}
+	if (next != reference_space_free.begin()) {
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == offset) {
+			previous->second += size;
+			return;
+		}
+	}
+	reference_space_free[offset] = size;
+}
+
+void* alloc_pages(size_t size, bool populate) {
+	char* pages = take_reference_pages(size, nullptr);
+	if (!pages) {
+		return nullptr;
+	}
+#ifdef _WIN32
+	(void) populate;
+	bool committed = VirtualAlloc(pages, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+	bool committed = mmap(pages, size, PROT_READ | PROT_WRITE,
+			HEAP_MAP_FLAGS | POPULATE_MAP_FLAG(populate) | MAP_FIXED, -1, 0) != MAP_FAILED;
+#endif
+	if (!committed) {
+		give_back_reference_pages(pages, size);
+		return nullptr;
+	}
+	return pages;
+}
+
+void free_pages(void* pages, size_t size) {
+	//Back to reserved, so that the memory goes back to the OS and reads as zero next time
+#ifdef _WIN32
+	VirtualFree(pages, size, MEM_DECOMMIT);
+#else
+	mmap(pages, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+	give_back_reference_pages((char*) pages, size);
+}
+
+void* map_file_pages(const char* path, uint64_t offset, size_t size, void* preferred) {
+	char* pages = take_reference_pages(size, preferred);
+	if (!pages) {
+		return nullptr;
+	}
+#ifdef _WIN32
+	std::ifstream in(path, std::ios::binary);
+	in.seekg(std::streamoff(offset));
+	if (!VirtualAlloc(pages, size, MEM_COMMIT, PAGE_READWRITE) ||
+			!in.read(pages, std::streamsize(size))) {
+		free_pages(pages, size);
+		return nullptr;
+	}
+#else
+	int fd = open(path, O_RDONLY);
+	//Replaces the reserved pages
+	void* mapped = fd < 0 || !file_covers(fd, offset, size) ? MAP_FAILED :
+			mmap(pages, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off_t(offset));
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (mapped == MAP_FAILED) {
+		give_back_reference_pages(pages, size);
+		return nullptr;
+	}
+#endif
+	return pages;
+}
+#else
+void* alloc_pages(size_t size, bool populate) {
+#ifdef _WIN32
+	(void) populate;
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, HEAP_MAP_FLAGS | POPULATE_MAP_FLAG(populate), -1, 0);
+	return pages == MAP_FAILED ? nullptr : pages;
+#endif
+}
+
+void free_pages(void* pages, size_t size) {
+#ifdef _WIN32
+	(void) size;
+	VirtualFree(pages, 0, MEM_RELEASE);
+#else
+	munmap(pages, size);
+#endif
+}
+
+void* map_file_pages(const char* path, uint64_t offset, size_t size, void* preferred) {
+#ifdef _WIN32
+	//Copy on write views can't be freed like the other pages, so the file is read instead
+	void* pages = VirtualAlloc(preferred, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!pages) {
+		pages = alloc_pages(size);
+	}
+	std::ifstream in(path, std::ios::binary);
+	in.seekg(std::streamoff(offset));
+	if (!pages || !in.read((char*) pages, std::streamsize(size))) {
+		if (pages) {
+			free_pages(pages, size);
+		}
+		return nullptr;
+	}
+	return pages;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	if (!file_covers(fd, offset, size)) {
+		close(fd);
+		return nullptr;
+	}
+	//Without MAP_FIXED, preferred is only a hint, honored when nothing is mapped there
+	void* pages = mmap(preferred, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, off_t(offset));
+	close(fd);
+	return pages == MAP_FAILED ? nullptr : pages;
+#endif
+}
+#endif
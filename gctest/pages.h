@@ -0,0 +1,126 @@
+#ifndef PAGES_H_
+#define PAGES_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#define HEAP_PAGE_SHIFT 12
+#define HEAP_PAGE_SIZE (size_t(1) << HEAP_PAGE_SHIFT)
+
+#ifdef GC_COMPRESSED_REFERENCES
+#if UINTPTR_MAX <= 0xFFFFFFFF
+#error "GC_COMPRESSED_REFERENCES needs a 64-bit platform"
+#endif
+/**
+ * With compressed references, every page from alloc_pages and map_file_pages comes from
+ * one range of REFERENCE_SPACE_SIZE bytes reserved up front at reference_space_base, so
+ * that an object is found from a 32-bit offset scaled by 1 << REFERENCE_SHIFT. The first
+ * page is never handed out, so that no object is at offset 0.
+ */
+#define REFERENCE_SHIFT 3
+#define REFERENCE_SPACE_SIZE (size_t(1) << (32 + REFERENCE_SHIFT))
+
+//Null until the first pages are allocated
+extern char* reference_space_base;
+#endif
+
+/**
+ * Page-aligned, zeroed memory straight from the OS, or from the reference space with
+ * GC_COMPRESSED_REFERENCES. size must be a multiple of HEAP_PAGE_SIZE. Returns null on failure.
+ * With populate, the pages are faulted in up front where the OS supports it, which only
+ * pays off for memory that is about to be written in full, like a large object.
+ */
+void* alloc_pages(size_t size, bool populate = false);
+void free_pages(void* pages, size_t size);
+/**
+ * Private, writable pages holding [offset, offset + size) of a file, placed at preferred if
+ * that range is free. Changes are not written back. offset and size must be multiples of
+ * HEAP_PAGE_SIZE. Returns null on failure, including when the file ends before
+ * offset + size, and is freed with free_pages.
+ */
+void* map_file_pages(const char* path, uint64_t offset, size_t size, void* preferred);
+
+/**
+ * Maps every page of the address space to a T*, or nullptr when unmapped.
+ * It is a three level radix tree, so lookups are three dependent loads,
+ * no matter how many pages are registered. Any address can be looked up,
+ * which makes it suitable for conservative scanning.
+ * Lookups may run on other threads while set_range adds pages (a concurrent marker
+ * while the mutator grows the heap), so the slots are accessed atomically.
+ */
+template <typename T>
+class page_map {
+	static const unsigned KEY_BITS = (sizeof(void*) == 8 ? 48 : 32) - HEAP_PAGE_SHIFT;
+	static const unsigned LEAF_BITS = KEY_BITS / 3;
+	static const unsigned MID_BITS = KEY_BITS / 3;
+	static const unsigned ROOT_BITS = KEY_BITS - LEAF_BITS - MID_BITS;
+
+	struct leaf_node {
+		T* values[size_t(1) << LEAF_BITS];
+	};
+
+	struct mid_node {
+		leaf_node* leaves[size_t(1) << MID_BITS];
+	};
+
+	mid_node** root;
+
+	inline leaf_node* find_leaf(uintptr_t key) const {
+		mid_node* mid = __atomic_load_n(&root[key >> (MID_BITS + LEAF_BITS)], __ATOMIC_ACQUIRE);
+		if (!mid) {
+			return nullptr;
+		}
+		return __atomic_load_n(&mid->leaves[(key >> LEAF_BITS) & ((size_t(1) << MID_BITS) - 1)],
+				__ATOMIC_ACQUIRE);
+	}
+public:
+	page_map() : root(new mid_node*[size_t(1) << ROOT_BITS]()) {}
+	page_map(const page_map& other) = delete;
+
+	~page_map() {
+		for (size_t i = 0; i < (size_t(1) << ROOT_BITS); ++i) {
+			if (!root[i]) {
+				continue;
+			}
+			for (size_t j = 0; j < (size_t(1) << MID_BITS); ++j) {
+				delete root[i]->leaves[j];
+			}
+			delete root[i];
+		}
+		delete[] root;
+	}
+
+	inline T* get(const void* addr) const {
+		uintptr_t key = uintptr_t(addr) >> HEAP_PAGE_SHIFT;
+		if (key >> KEY_BITS) {
+			//Outside of the user address space
+			return nullptr;
+		}
+
+		leaf_node* leaf = find_leaf(key);
+		if (!leaf) {
+			return nullptr;
+		}
+		return __atomic_load_n(&leaf->values[key & ((size_t(1) << LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+	}
+
+	void set_range(const void* start, size_t size, T* value) {
+		uintptr_t first_key = uintptr_t(start) >> HEAP_PAGE_SHIFT;
+		uintptr_t last_key = (uintptr_t(start) + size - 1) >> HEAP_PAGE_SHIFT;
+
+		for (uintptr_t key = first_key; key <= last_key; ++key) {
+			//Only one thread adds pages, so new nodes just need to be complete when published
+			mid_node*& mid = root[key >> (MID_BITS + LEAF_BITS)];
+			if (!mid) {
+				__atomic_store_n(&mid, new mid_node(), __ATOMIC_RELEASE);
+			}
+			leaf_node*& leaf = mid->leaves[(key >> LEAF_BITS) & ((size_t(1) << MID_BITS) - 1)];
+			if (!leaf) {
+				__atomic_store_n(&leaf, new leaf_node(), __ATOMIC_RELEASE);
+			}
+			__atomic_store_n(&leaf->values[key & ((size_t(1) << LEAF_BITS) - 1)], value, __ATOMIC_RELEASE);
+		}
+	}
+};
+
+#endif /* PAGES_H_ */